@@ -33,6 +33,7 @@
 #include "upmpd.hxx"
 #include "upmpdutils.hxx"
 #include "smallut.h"
+#include "textkern.h"
 #include "conftree.h"
 
 // For testing upplay with a dumb renderer.
@@ -379,7 +380,7 @@ bool UpMpdAVTransport::getEventData(bool all, std::vector<std::string>& names,
         chgdata += "<";
         chgdata += it->first;
         chgdata += " val=\"";
-        chgdata += SoapHelp::xmlQuote(it->second);
+        xmlEscapeAppend(it->second, chgdata);
         chgdata += "\"/>\n";
     }
     chgdata += "</InstanceID>\n</Event>\n";
@@ -579,7 +580,7 @@ int UpMpdAVTransport::getPositionInfo(const SoapIncoming& sc, SoapOutgoing& data
 
     const string& uri = mpds.currentsong.rsrc.uri;
     if (is_song && !uri.empty()) {
-        data.addarg("TrackURI", SoapHelp::xmlQuote(uri));
+        data.addarg("TrackURI", xmlEscape(uri));
     } else {
         data.addarg("TrackURI", "");
     }
@@ -638,7 +639,7 @@ int UpMpdAVTransport::getMediaInfo(const SoapIncoming& sc, SoapOutgoing& data)
 
     const string& thisuri = mpds.currentsong.rsrc.uri;
     if (is_song && !thisuri.empty()) {
-        data.addarg("CurrentURI", SoapHelp::xmlQuote(thisuri));
+        data.addarg("CurrentURI", xmlEscape(thisuri));
     } else {
         data.addarg("CurrentURI", "");
     }
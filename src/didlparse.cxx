@@ -0,0 +1,329 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+
+#include "didlparse.hxx"
+
+#include <string.h>
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "libupnpp/log.hxx"
+#include "libupnpp/upnpavutils.hxx"
+#include "libupnpp/control/cdircontent.hxx"
+
+#include "smallut.h"
+#include "textkern.h"
+
+using namespace std;
+using namespace UPnPP;
+using namespace UPnPClient;
+
+// Max number of cached parse results. Control points usually send
+// the metadata for the current and next tracks, plus a few playlist
+// insertions.
+static const size_t didlcachesize = 64;
+
+static const char *wspace = " \t\n\r";
+
+static inline bool isTagEnd(char c)
+{
+    return c == ' ' || c == '>' || c == '/' || c == '\t' || c == '\n' ||
+        c == '\r';
+}
+
+// Find start of element tag (e.g. "<item") between pos and end.
+static string::size_type findTag(const string& s, const string& tag,
+                                 string::size_type pos,
+                                 string::size_type end)
+{
+    const string stag = "<" + tag;
+    for (;;) {
+        pos = s.find(stag, pos);
+        if (pos == string::npos || pos + stag.size() >= end) {
+            return string::npos;
+        }
+        if (isTagEnd(s[pos + stag.size()])) {
+            return pos;
+        }
+        pos += stag.size();
+    }
+}
+
+// Check that the namespace prefix is bound once, to the standard URI.
+static bool prefixIs(const string& didl, const char *pfx, const char *uri)
+{
+    const string decl = string("xmlns:") + pfx + "=";
+    string::size_type pos = didl.find(decl);
+    if (pos == string::npos || didl.find(decl, pos + 1) != string::npos) {
+        return false;
+    }
+    pos += decl.size();
+    if (pos >= didl.size() || (didl[pos] != '"' && didl[pos] != '\'')) {
+        return false;
+    }
+    char quote = didl[pos++];
+    size_t ulen = strlen(uri);
+    return didl.compare(pos, ulen, uri) == 0 && pos + ulen < didl.size() &&
+        didl[pos + ulen] == quote;
+}
+
+static string textValue(const string& s, string::size_type pos,
+                        string::size_type len)
+{
+    string out = xmlUnescape(s.substr(pos, len));
+    trimstring(out, wspace);
+    return out;
+}
+
+// Extract the character data for a simple property element inside
+// [from, end). Returns 1 if found, 0 if absent, -1 if the element is
+// not something we want to handle here (attributes, repeated, or
+// containing markup).
+static int propValue(const string& s, const string& tag,
+                     string::size_type from, string::size_type end,
+                     string& value)
+{
+    string::size_type pos = findTag(s, tag, from, end);
+    if (pos == string::npos) {
+        return 0;
+    }
+    pos += tag.size() + 1;
+    if (s[pos] != '>') {
+        return -1;
+    }
+    pos++;
+    const string etag = "</" + tag + ">";
+    string::size_type close = s.find(etag, pos);
+    if (close == string::npos || close >= end ||
+        s.find('<', pos) != close) {
+        return -1;
+    }
+    if (findTag(s, tag, close, end) != string::npos) {
+        return -1;
+    }
+    value = textValue(s, pos, close - pos);
+    return 1;
+}
+
+// Parse the attributes in the start tag [pos, gt). Only the ones we
+// use are kept.
+static bool resAttrs(const string& s, string::size_type pos,
+                     string::size_type gt, string& protoinfo,
+                     string& duration)
+{
+    for (;;) {
+        pos = s.find_first_not_of(wspace, pos);
+        if (pos >= gt) {
+            return true;
+        }
+        string::size_type eq = s.find('=', pos);
+        if (eq >= gt) {
+            return false;
+        }
+        string name = s.substr(pos, eq - pos);
+        trimstring(name, wspace);
+        pos = s.find_first_not_of(wspace, eq + 1);
+        if (pos >= gt || (s[pos] != '"' && s[pos] != '\'')) {
+            return false;
+        }
+        string::size_type vend = s.find(s[pos], pos + 1);
+        if (vend >= gt) {
+            return false;
+        }
+        if (name == "protocolInfo") {
+            protoinfo = textValue(s, pos + 1, vend - pos - 1);
+        } else if (name == "duration") {
+            duration = textValue(s, pos + 1, vend - pos - 1);
+        }
+        pos = vend + 1;
+    }
+}
+
+// Extract the content format from a protocolInfo value. This does
+// the same thing as parseProtocolInfo(), without the list handling.
+static bool contentFormat(const string& protoinfo, string& cf)
+{
+    vector<string> fields;
+    stringToTokens(protoinfo, fields, ":");
+    if (fields.size() != 4) {
+        return false;
+    }
+    string::size_type semi = fields[2].find(';');
+    cf = fields[2].substr(0, semi);
+    trimstring(cf, wspace);
+    return true;
+}
+
+// Quick extraction of the data we need from a simple single-item
+// document. Anything unusual makes us return false, and the caller
+// will use the full parser.
+static bool quickScan(const string& didl, DidlSummary& sum)
+{
+    if (didl.find("<![CDATA[") != string::npos ||
+        didl.find("<!--") != string::npos ||
+        didl.find("<!DOCTYPE") != string::npos) {
+        return false;
+    }
+    if (!prefixIs(didl, "dc", "http://purl.org/dc/elements/1.1/") ||
+        !prefixIs(didl, "upnp", "urn:schemas-upnp-org:metadata-1-0/upnp/")) {
+        return false;
+    }
+    if (findTag(didl, "container", 0, didl.size()) != string::npos) {
+        return false;
+    }
+    string::size_type itemstart = findTag(didl, "item", 0, didl.size());
+    if (itemstart == string::npos ||
+        findTag(didl, "item", itemstart + 1, didl.size()) != string::npos) {
+        return false;
+    }
+    string::size_type itemend = didl.find("</item>", itemstart);
+    if (itemend == string::npos) {
+        return false;
+    }
+
+    UpSong& song = sum.song;
+    if (propValue(didl, "dc:title", itemstart, itemend, song.title) < 0 ||
+        propValue(didl, "upnp:artist", itemstart, itemend, song.artist) < 0 ||
+        propValue(didl, "upnp:album", itemstart, itemend, song.album) < 0 ||
+        propValue(didl, "upnp:originalTrackNumber", itemstart, itemend,
+                  song.tracknum) < 0) {
+        return false;
+    }
+
+    song.rsrc.duration_secs = 0;
+    string::size_type pos = itemstart;
+    while ((pos = findTag(didl, "res", pos + 1, itemend)) != string::npos) {
+        string::size_type gt = didl.find('>', pos);
+        if (gt >= itemend) {
+            return false;
+        }
+        bool empty = didl[gt-1] == '/';
+        string protoinfo, duration;
+        if (!resAttrs(didl, pos + 4, empty ? gt - 1 : gt, protoinfo,
+                      duration)) {
+            return false;
+        }
+        DidlSummary::Res res;
+        if (!empty) {
+            string::size_type close = didl.find("</res>", gt);
+            if (close >= itemend || didl.find('<', gt) != close) {
+                return false;
+            }
+            res.uri = textValue(didl, gt + 1, close - gt - 1);
+            pos = close;
+        } else {
+            pos = gt;
+        }
+        res.hasproto = contentFormat(protoinfo, res.contentFormat);
+        if (sum.resources.empty() && !duration.empty()) {
+            song.rsrc.duration_secs = upnpdurationtos(duration);
+        }
+        sum.resources.push_back(res);
+    }
+    sum.ok = true;
+    return true;
+}
+
+static void fullParse(const string& didl, DidlSummary& sum)
+{
+    UPnPDirContent dirc;
+    if (!dirc.parse(didl) || dirc.m_items.size() == 0) {
+        return;
+    }
+    const UPnPDirObject& dobj = *dirc.m_items.begin();
+    dirObjToUpSong(dobj, &sum.song);
+    for (const auto& resource : dobj.m_resources) {
+        DidlSummary::Res res;
+        res.uri = resource.m_uri;
+        ProtocolinfoEntry e;
+        if (resource.protoInfo(e)) {
+            res.hasproto = true;
+            res.contentFormat = e.contentFormat;
+        }
+        sum.resources.push_back(res);
+    }
+    sum.ok = true;
+}
+
+static shared_ptr<const DidlSummary> parse(const string& didl)
+{
+    auto sum = make_shared<DidlSummary>();
+    if (!quickScan(didl, *sum)) {
+        LOGDEB1("didlSummary: using full parser\n");
+        *sum = DidlSummary();
+        fullParse(didl, *sum);
+    }
+    return sum;
+}
+
+// LRU list of (didl, summary), most recently used first. The map is
+// indexed by the document hash. The document text is kept to check
+// for hash collisions.
+typedef list<pair<string, shared_ptr<const DidlSummary> > > lru_type;
+static lru_type lrulist;
+static unordered_map<size_t, lru_type::iterator> lrumap;
+static mutex lrumutex;
+
+shared_ptr<const DidlSummary> didlSummary(const string& didl)
+{
+    if (didl.empty()) {
+        return make_shared<DidlSummary>();
+    }
+    size_t key = std::hash<string>()(didl);
+    {
+        std::unique_lock<std::mutex> lock(lrumutex);
+        auto it = lrumap.find(key);
+        if (it != lrumap.end() && it->second->first == didl) {
+            lrulist.splice(lrulist.begin(), lrulist, it->second);
+            return it->second->second;
+        }
+    }
+
+    // Parse without holding the lock.
+    shared_ptr<const DidlSummary> sum = parse(didl);
+
+    std::unique_lock<std::mutex> lock(lrumutex);
+    auto it = lrumap.find(key);
+    if (it != lrumap.end()) {
+        // Collision, or someone else did the job in the meantime
+        lrulist.erase(it->second);
+        lrumap.erase(it);
+    }
+    lrulist.push_front(make_pair(didl, sum));
+    lrumap[key] = lrulist.begin();
+    while (lrulist.size() > didlcachesize) {
+        lrumap.erase(std::hash<string>()(lrulist.back().first));
+        lrulist.pop_back();
+    }
+    return sum;
+}
+
+void didlSummaryToUpSong(const DidlSummary& sum, UpSong *ups)
+{
+    if (ups) {
+        ups->artist = sum.song.artist;
+        ups->album = sum.song.album;
+        ups->title = sum.song.title;
+        ups->rsrc.duration_secs = sum.song.rsrc.duration_secs;
+        ups->tracknum = sum.song.tracknum;
+    }
+}
@@ -0,0 +1,64 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#ifndef _DIDLPARSE_H_X_INCLUDED_
+#define _DIDLPARSE_H_X_INCLUDED_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "upmpdutils.hxx"
+
+// Parsing of the DIDL metadata sent by Control Points along with
+// track URIs (SetAVTransportURI, OHPlaylist Insert, OHReceiver
+// SetSender...).
+//
+// The same metadata is typically received many times (e.g. Insert
+// then SeekId, or SetNextAVTransportURI then SetAVTransportURI for
+// the same track), so the parse results are kept in a small LRU
+// cache. Also, most of the time, the document holds a single item
+// with a simple structure, and we only need a few fields from it: a
+// quick scanner extracts them without building the expat-based
+// UPnPDirContent tree, which is only used for the hard cases.
+
+struct DidlSummary {
+    // A resource from the first item
+    struct Res {
+        std::string uri;
+        // Third field of the protocolInfo attribute. Only valid if
+        // hasproto is set.
+        std::string contentFormat;
+        bool hasproto{false};
+    };
+
+    // Parse succeeded and the document had at least one item.
+    bool ok{false};
+    // Values for the first item: artist, album, title, tracknum and
+    // rsrc.duration_secs are set (same as dirObjToUpSong()).
+    UpSong song;
+    std::vector<Res> resources;
+};
+
+// Parse DIDL metadata, or get the result from the cache. The returned
+// object is shared with the cache and must not be modified.
+extern std::shared_ptr<const DidlSummary> didlSummary(const std::string& didl);
+
+// Copy the summary song fields to the output UpSong.
+extern void didlSummaryToUpSong(const DidlSummary& sum, UpSong *ups);
+
+#endif /* _DIDLPARSE_H_X_INCLUDED_ */
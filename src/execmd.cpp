@@ -886,6 +886,26 @@ int ExecCmd::receive(string& data, int cnt)
         LOGERR("ExecCmd::receive: inpipe is closed\n");
         return -1;
     }
+    if (cnt > 0) {
+        // Known size: read directly into the output string.
+        string::size_type start = data.size();
+        data.resize(start + cnt);
+        int ntot = 0;
+        while (ntot < cnt) {
+            int n = con->receive(&data[start + ntot], cnt - ntot);
+            if (n < 0) {
+                LOGERR("ExecCmd::receive: error\n");
+                data.resize(start + ntot);
+                return -1;
+            } else if (n == 0) {
+                LOGDEB("ExecCmd::receive: got 0\n");
+                break;
+            }
+            ntot += n;
+        }
+        data.resize(start + ntot);
+        return ntot;
+    }
     const int BS = 4096;
     char buf[BS];
     int ntot = 0;
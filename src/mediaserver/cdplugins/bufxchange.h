@@ -18,11 +18,13 @@
 #define _BUFFERXCHANGE_H_INCLUDED_
 
 #include <thread>
+#include <atomic>
 #include <string>
 #include <queue>
 #include <list>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 
 #ifdef MDU_INCLUDE_LOG
 #include MDU_INCLUDE_LOG
@@ -30,6 +32,44 @@
 #include "log.h"
 #endif
 
+/**
+ * Byte budget shared by a set of BufXChange queues, e.g. all the
+ * streams of an HTTP proxy. This just keeps the count, the queues
+ * decide what to do with it (see BufXChange::setBudget()).
+ */
+class BufBudget {
+public:
+    /** @param maxbytes the budget. 0 means no limit. */
+    BufBudget(size_t maxbytes = 0)
+        : m_max(maxbytes) {
+    }
+    void setmax(size_t maxbytes) {
+        m_max = maxbytes;
+    }
+    size_t max() const {
+        return m_max;
+    }
+    size_t used() const {
+        return m_used;
+    }
+    size_t peak() const {
+        return m_peak;
+    }
+    void add(size_t cnt) {
+        size_t used = m_used += cnt;
+        size_t peak = m_peak;
+        while (used > peak && !m_peak.compare_exchange_weak(peak, used))
+            ;
+    }
+    void sub(size_t cnt) {
+        m_used -= cnt;
+    }
+private:
+    std::atomic<size_t> m_max;
+    std::atomic<size_t> m_used{0};
+    std::atomic<size_t> m_peak{0};
+};
+
 /**
  * A BufferXChange is a synchronized 2 way meeting point for 2 threads
  * exchanging objects (or 1 thread sending objects to another).
@@ -42,6 +82,11 @@
  * T has to be a pointer type.
  * BufXChange will delete excess recycled objects, and any remaining on the 
  * queues at delete time.
+ *
+ * The queue can also keep count of the data bytes it holds, and
+ * tell the client when it should stop producing (setBudget(),
+ * full(), drained()). Unlike the item count limit, this does not
+ * block put(): the client is supposed to stop its data source.
  */
 template <class T> class BufXChange {
 public:
@@ -61,6 +106,7 @@ public:
         while (m_queue.size()) {
             T t = m_queue.front();
             m_queue.pop_front();
+            subbytes(t);
             delete t;
         }
         while (m_rqueue.size()) {
@@ -90,11 +136,13 @@ public:
             while (!m_queue.empty()) {
                 T t = m_queue.front();
                 m_queue.pop_front();
+                subbytes(t);
                 delete t;
             }
         }
 
         m_queue.push_back(t);
+        addbytes(t);
         if (m_workers_waiting > 0) {
             // Just wake one worker, there is only one new task.
             m_wcond.notify_one();
@@ -103,6 +151,21 @@ public:
         return true;
     }
 
+    // Called from client to modify the last queued item in place,
+    // e.g. append data to it instead of queueing a new one. Returns
+    // false if the queue is empty or if f does. The item is not
+    // visible to the worker while f runs.
+    bool modifyback(std::function<bool(T&)> f) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!ok() || m_queue.empty()) {
+            return false;
+        }
+        subbytes(m_queue.back());
+        bool ret = f(m_queue.back());
+        addbytes(m_queue.back());
+        return ret;
+    }
+
     // Called from worker to put a (probably partially processed)
     // buffer at the front of the queue.
     bool untake(T t) {
@@ -111,6 +174,7 @@ public:
             return false;
         }
         m_queue.push_front(t);
+        addbytes(t);
         return true;
     }
     
@@ -191,12 +255,32 @@ public:
             *szp = m_queue.size();
         }
         m_queue.pop_front();
+        subbytes(*tp);
         if (m_clients_waiting > 0) {
             // No reason to wake up more than one client thread
             m_ccond.notify_one();
         }
         return true;
     }
+    /** Take task from queue if one is available. Called from worker.
+     *
+     * Does not sleep: returns false if the queue is empty (or
+     * terminated, which the next take() will report).
+     */
+    bool take_nowait(T* tp) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!ok() || m_queue.empty()) {
+            return false;
+        }
+        *tp = m_queue.front();
+        m_queue.pop_front();
+        subbytes(*tp);
+        if (m_clients_waiting > 0) {
+            m_ccond.notify_one();
+        }
+        return true;
+    }
+
     bool recycle(T t) {
         std::unique_lock<std::mutex> lock(m_mutex);
         return recycle_nolock(t);
@@ -259,6 +343,7 @@ public:
         while (m_queue.size()) {
             T t = m_queue.front();
             m_queue.pop_front();
+            subbytes(t);
             recycle_nolock(t);
         }
         m_clients_waiting = m_workers_waiting = 0;
@@ -267,12 +352,103 @@ public:
         m_wcond.notify_all();
     }
 
+    /** Set a byte budget for the queue contents. Call before use.
+     * @param sizer returns the data size for an item.
+     * @param hibytes the queue budget (high watermark), 0 for no limit.
+     * @param global optional budget shared with other queues.
+     * @param minbytes the queue can always hold this, whatever the
+     *   global usage, so that a stream is never starved by the others.
+     */
+    void setBudget(std::function<size_t(const T&)> sizer, size_t hibytes,
+                   BufBudget *global = nullptr, size_t minbytes = 0) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_sizer = sizer;
+        m_hibytes = hibytes;
+        m_global = global;
+        m_minbytes = minbytes;
+    }
+
+    /** Called from client: should it stop producing for now ? This
+     * is true when the queue budget is used up, or, if the queue
+     * holds more than minbytes, when the global one is.
+     */
+    bool full() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        bool ret = (m_hibytes && m_bytes >= m_hibytes) ||
+            (m_global && m_global->max() && m_bytes > m_minbytes &&
+             m_global->used() >= m_global->max());
+        if (ret) {
+            m_fullcnt++;
+        }
+        return ret;
+    }
+
+    /** Called from client after full(): can it resume ? The low
+     * watermarks are half the queue budget and 3/4 of the global one,
+     * so that we don't stop/start for every item.
+     */
+    bool drained() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_hibytes && m_bytes > m_hibytes / 2) {
+            return false;
+        }
+        if (m_global && m_global->max() && m_bytes > m_minbytes / 2 &&
+            m_global->used() > m_global->max() - m_global->max() / 4) {
+            return false;
+        }
+        return true;
+    }
+
+    struct Stats {
+        // Bytes currently queued, and max reached
+        size_t bytes{0};
+        size_t peakbytes{0};
+        // High and low watermarks (0 if no limit)
+        size_t hibytes{0};
+        size_t lobytes{0};
+        // Count of full() returning true
+        unsigned int fullcnt{0};
+    };
+    Stats stats() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        Stats st;
+        st.bytes = m_bytes;
+        st.peakbytes = m_peakbytes;
+        st.hibytes = m_hibytes;
+        st.lobytes = m_hibytes / 2;
+        st.fullcnt = m_fullcnt;
+        return st;
+    }
+
     const std::string& getname() const {return m_name;}
 private:
     bool ok() {
         return m_ok;
     }
 
+    // Byte accounting, called with the lock held.
+    void addbytes(const T& t) {
+        if (m_sizer) {
+            size_t cnt = m_sizer(t);
+            m_bytes += cnt;
+            if (m_bytes > m_peakbytes) {
+                m_peakbytes = m_bytes;
+            }
+            if (m_global) {
+                m_global->add(cnt);
+            }
+        }
+    }
+    void subbytes(const T& t) {
+        if (m_sizer) {
+            size_t cnt = m_sizer(t);
+            m_bytes -= cnt;
+            if (m_global) {
+                m_global->sub(cnt);
+            }
+        }
+    }
+
     // Configuration
     std::string m_name;
     size_t m_high;
@@ -290,6 +466,15 @@ private:
 
     // Queue for recycling the objects
     std::queue<T> m_rqueue;
+
+    // Byte budget
+    std::function<size_t(const T&)> m_sizer;
+    size_t m_hibytes{0};
+    size_t m_minbytes{0};
+    BufBudget *m_global{nullptr};
+    size_t m_bytes{0};
+    size_t m_peakbytes{0};
+    unsigned int m_fullcnt{0};
     
     // Synchronization
     std::condition_variable m_ccond;
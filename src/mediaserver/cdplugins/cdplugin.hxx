@@ -18,11 +18,92 @@
 #define _CDPLUGIN_H_INCLUDED_
 
 #include <string>
+#include <vector>
+
 #include "upmpdutils.hxx"
 #include "libupnpp/device/vdir.hxx"
 
 class CDPluginServices;
 
+/// Receiver for the Browse and Search results.
+///
+/// Plugins output their entries either as UpSong objects, or, if they
+/// have them in this form (e.g. from a cache), as pre-rendered DIDL
+/// fragments, which can then be copied as-is to the output.
+class CDResultSink {
+public:
+    virtual ~CDResultSink() {}
+
+    /// Hint for the size of the data to come (DIDL bytes).
+    virtual void reserve(size_t) {}
+
+    /// Output one entry.
+    virtual void add(const UpSong& entry) = 0;
+
+    /// UpSong::PropFlags value for pre-rendered data. 0 if the sink
+    /// can't use DIDL fragments, and only accepts add().
+    virtual unsigned int didlProps() const {
+        return 0;
+    }
+
+    /// Output count entries as DIDL data, which must have been
+    /// rendered with the didlProps() flags.
+    virtual void addDidl(const char *, size_t, int) {}
+
+    /// Count of entries output so far.
+    int count() const {
+        return m_count;
+    }
+
+protected:
+    int m_count{0};
+};
+
+/// Result sink building the DIDL document for the Browse/Search
+/// Result argument.
+class CDDidlSink : public CDResultSink {
+public:
+    CDDidlSink(std::string& out, unsigned int props = UpSong::PF_ALL)
+        : m_out(out), m_props(props) {
+        m_out = headDIDL();
+    }
+    virtual void reserve(size_t bytes) override {
+        m_out.reserve(m_out.size() + bytes + tailDIDL().size());
+    }
+    virtual void add(const UpSong& entry) override {
+        entry.didl(m_out, m_props);
+        m_count++;
+    }
+    virtual unsigned int didlProps() const override {
+        return m_props;
+    }
+    virtual void addDidl(const char *data, size_t len, int count) override {
+        m_out.append(data, len);
+        m_count += count;
+    }
+    /// Terminate the document. Call once, after the last entry.
+    void close() {
+        m_out += tailDIDL();
+    }
+private:
+    std::string& m_out;
+    unsigned int m_props;
+};
+
+/// Result sink storing UpSong objects in a vector.
+class CDVectorSink : public CDResultSink {
+public:
+    CDVectorSink(std::vector<UpSong>& entries)
+        : m_entries(entries) {
+    }
+    virtual void add(const UpSong& entry) override {
+        m_entries.push_back(entry);
+        m_count++;
+    }
+private:
+    std::vector<UpSong>& m_entries;
+};
+
 /// Interface to Content Directory plugins
 ///
 /// The main operations, Browse and Search, return content as UpSong
@@ -62,16 +143,27 @@ public:
     //     be '0$plugin_name$', e.g. '0$qobuz$'
     /// @param stidx first entry to return.
     /// @param cnt number of entries.
-    /// @param[output] entries output content.
+    /// @param[output] sink receives the output content.
     /// @param sortcrits csv list of sort criteria.
     /// @param flg browse flag
     /// @return total number of matched entries in container
     virtual int browse(
 	const std::string& objid, int stidx, int cnt,
-	std::vector<UpSong>& entries,
+	CDResultSink& sink,
 	const std::vector<std::string>& sortcrits = std::vector<std::string>(),
 	BrowseFlag flg = BFChildren) = 0;
 
+    /// Browse, returning the entries in a vector.
+    int browse(
+	const std::string& objid, int stidx, int cnt,
+	std::vector<UpSong>& entries,
+	const std::vector<std::string>& sortcrits = std::vector<std::string>(),
+	BrowseFlag flg = BFChildren) {
+        entries.clear();
+        CDVectorSink sink(entries);
+        return browse(objid, stidx, cnt, sink, sortcrits, flg);
+    }
+
     /// Search under object at objid.
     ///
     /// This reflects an UPnP Search action, refer to UPnP
@@ -82,20 +174,34 @@ public:
     /// @param objid the object to search
     /// @param stidx first entry to return.
     /// @param cnt number of entries.
-    /// @param[output] entries output content.
+    /// @param[output] sink receives the output content.
     /// @param sortcrits csv list of sort criteria.
     /// @return total number of matched entries in container
     virtual int search(
 	const std::string& ctid, int stidx, int cnt,
 	const std::string& searchstr,
-	std::vector<UpSong>& entries,
+	CDResultSink& sink,
 	const std::vector<std::string>& sortcrits = std::vector<std::string>())
     = 0;
 
+    /// Search, returning the entries in a vector.
+    int search(
+	const std::string& ctid, int stidx, int cnt,
+	const std::string& searchstr,
+	std::vector<UpSong>& entries,
+	const std::vector<std::string>& sortcrits = std::vector<std::string>()) {
+        entries.clear();
+        CDVectorSink sink(entries);
+        return search(ctid, stidx, cnt, searchstr, sink, sortcrits);
+    }
+
     const std::string& getname() {
         return m_name;
     }
 
+    /// Start the plugin processes, if any, so that the first access
+    /// does not have to wait. This is also called periodically and
+    /// should restart any process which exited.
     virtual bool startInit() = 0;
 
     std::string m_name;
@@ -123,20 +229,27 @@ public:
     /// accessible from clients (in case this server has several
     /// interfaces). These calls are unused at present because no
     /// plugin uses the libupnp miniserver (tidal/qobuz/spotify/google
-    /// use the microhttpd started by plgwithslave and uprcl uses a
-    /// python server).
+    /// and the uprcl track files use the microhttpd started by
+    /// plgwithslave, uprcl also has a python server).
     virtual std::string getupnpaddr(CDPlugin *) = 0;
     virtual int getupnpport(CDPlugin *) = 0;
 
+    /// Signal a content change. objid is the changed container, the
+    /// plugin root if the plugin can't be more specific. This updates
+    /// the ContentDirectory update ids, which are evented to the
+    /// Control Points, so that they can refresh their caches.
+    virtual void contentChanged(const std::string& objid) = 0;
+
     /// Port on which the microhttp server listens on. Static because
     /// needed to start a proxy in conjunction with ohcredentials.
     /// Port 49149 is used by default. The value can be changed with
     /// the "plgmicrohttpport" configuration variable.
     ///
-    /// Note: The local mediaserver (uprcl) uses neither the libupnp
-    /// HTTP server nor microhttpd, but an internal Python server
-    /// instance, on port 9090 by default (can be changed with the
-    /// "uprclhostport" configuration variable).
+    /// Note: The local mediaserver (uprcl) serves the track files
+    /// through microhttpd (unless "uprclnativestream" is false), but
+    /// the cover art and its configuration interface are served by an
+    /// internal Python server instance, on port 9090 by default (can
+    /// be changed with the "uprclhostport" configuration variable).
     static int microhttpport();
 
     /// microhttp server IP host. The default is to use the same
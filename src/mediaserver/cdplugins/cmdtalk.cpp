@@ -17,10 +17,15 @@
 #include "cmdtalk.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
-#include <sstream>
+#include <memory>
 #include <mutex>
+#include <thread>
 
 #include "smallut.h"
 #include "execmd.h"
@@ -58,18 +63,43 @@ public:
 	: m_cancel(timeosecs) {}
 
     ~Internal() {
+        stopReader();
 	delete cmd;
     }
 
-    bool readDataElement(string& name, string &data);
+    bool readDataElement(string& name, string &data, bool idle = false);
+    bool readMessage(unordered_map<string, string>& rep, bool idle = false);
+    bool sendMessage(const pair<string, string>& arg0,
+                     const unordered_map<string, string>& args,
+                     const string& rqid);
 
     bool talk(const pair<string, string>& arg0,
 	      const unordered_map<string, string>& args,
 	      unordered_map<string, string>& rep);
+    bool talkAsync(const pair<string, string>& arg0,
+                   const unordered_map<string, string>& args,
+                   ReplyCallback cb);
+    std::future<Reply> talkFuture(const pair<string, string>& arg0,
+                                  const unordered_map<string, string>& args);
+
+    // Version 2: read the answers and dispatch them to the waiting
+    // callbacks.
+    void readerLoop();
+    void stopReader();
 
     ExecCmd *cmd{0};
     Canceler m_cancel;
+    // Version 1: one exchange at a time
     std::mutex mmutex;
+
+    std::atomic<int> version{1};
+    // Version 2. Only the reader thread reads from or reaps the
+    // process. Other threads ask it to exit if something goes wrong.
+    std::mutex wmutex;
+    std::mutex pmutex;
+    unsigned int nextid{0};
+    unordered_map<unsigned int, ReplyCallback> pending;
+    std::thread reader;
 };
 
 CmdTalk::CmdTalk(int timeosecs)
@@ -88,6 +118,8 @@ bool CmdTalk::startCmd(const string& cmdname,
 {
     LOGDEB("CmdTalk::startCmd\n" );
 
+    m->stopReader();
+    m->version = 1;
     delete m->cmd;
     m->cmd = new ExecCmd;
     m->cmd->setAdvise(&m->m_cancel);
@@ -112,7 +144,17 @@ bool CmdTalk::startCmd(const string& cmdname,
     if (m->cmd->startExec(acmdname, args, 1, 1) < 0) {
         return false;
     }
-    return true;
+
+    // Try to switch to protocol version 2. Older scripts will return
+    // an error status.
+    unordered_map<string, string> rep;
+    if (m->talk({"cmdtalk:version", "2"}, {}, rep) &&
+        rep["cmdtalk:version"] == "2") {
+        m->version = 2;
+        m->reader = std::thread(&Internal::readerLoop, m);
+    }
+    LOGDEB("CmdTalk::startCmd: protocol version " << m->version << endl);
+    return running();
 }
 
 // Messages are made of data elements. Each element is like:
@@ -120,11 +162,17 @@ bool CmdTalk::startCmd(const string& cmdname,
 // An empty line signals the end of the message, so the whole thing
 // would look like:
 // Name1: Len1\nData1Name2: Len2\nData2\n
-bool CmdTalk::Internal::readDataElement(string& name, string &data)
+// If idle is set, we are waiting for the start of a message with no
+// request in flight (version 2 reader), and there is no timeout.
+bool CmdTalk::Internal::readDataElement(string& name, string &data, bool idle)
 {
     string ibuf;
 
-    m_cancel.reset();
+    if (idle) {
+        m_cancel.m_starttime = 0;
+    } else {
+        m_cancel.reset();
+    }
     try {
         // Read name and length
         if (cmd->getline(ibuf) <= 0) {
@@ -145,23 +193,22 @@ bool CmdTalk::Internal::readDataElement(string& name, string &data)
         return true;
     }
 
-    // We're expecting something like Name: len\n
-    vector<string> tokens;
-    stringToTokens(ibuf, tokens);
-    if (tokens.size() != 2) {
-        LOGERR("CmdTalk: bad line in filter output: ["  << (ibuf) << "]\n" );
-        return false;
+    // We're expecting something like Name: len\n. Parse in place.
+    string::size_type sep = ibuf.find_first_of(" \t");
+    char *endp = nullptr;
+    long len = -1;
+    if (sep != string::npos && sep > 0) {
+        len = strtol(ibuf.c_str() + sep, &endp, 10);
     }
-    vector<string>::iterator it = tokens.begin();
-    name = *it++;
-    string& slen = *it;
-    int len;
-    if (sscanf(slen.c_str(), "%d", &len) != 1) {
+    if (len < 0 || endp == ibuf.c_str() + sep ||
+        endp[strspn(endp, " \t\r\n")] != 0) {
         LOGERR("CmdTalk: bad line in filter output: ["  << (ibuf) << "]\n" );
         return false;
     }
+    name.assign(ibuf, 0, sep);
 
-    // Read element data
+    // Read element data. This goes straight from the connection
+    // buffer into the string, which is then moved into the reply.
     data.erase();
     if (len > 0 && cmd->receive(data, len) != len) {
         LOGERR("CmdTalk: expected " << len << " bytes of data, got " <<
@@ -173,45 +220,120 @@ bool CmdTalk::Internal::readDataElement(string& name, string &data)
     return true;
 }
 
-bool CmdTalk::Internal::talk(const pair<string, string>& arg0,
-			     const unordered_map<string, string>& args,
-			     unordered_map<string, string>& rep)
+bool CmdTalk::Internal::readMessage(unordered_map<string, string>& rep,
+                                    bool idle)
 {
-    std::unique_lock<std::mutex> lock(mmutex);
-    if (cmd->getChildPid() <= 0) {
-	LOGERR("CmdTalk::talk: no process\n");
-        return false;
+    for (;;) {
+        string name, data;
+	if (!readDataElement(name, data, idle)) {
+	    return false;
+	}
+        idle = false;
+        if (name.empty()) {
+            return true;
+	}
+	trimstring(name, ":");
+	LOGDEB1("CmdTalk: got [" << name << "] -> [" << data << "]\n");
+	rep[name].swap(data);
     }
+}
+
+static const string rqidkey("cmdtalk:rqid");
+
+// Size of "name: len\n" + value, with len < 10^20
+static inline size_t elementSize(const string& name, const string& value)
+{
+    return name.size() + value.size() + 24;
+}
+
+static void appendElement(string& out, const string& name, const string& value)
+{
+    char buf[30];
+    int n = snprintf(buf, sizeof(buf), ": %lu\n", (unsigned long)value.size());
+    out.append(name);
+    out.append(buf, n);
+    out.append(value);
+}
 
-    ostringstream obuf;
+bool CmdTalk::Internal::sendMessage(const pair<string, string>& arg0,
+                                    const unordered_map<string, string>& args,
+                                    const string& rqid)
+{
+    // Build the message in a single buffer, sized in advance, and
+    // send it with one write.
+    size_t sz = 1;
+    if (!arg0.first.empty()) {
+        sz += elementSize(arg0.first, arg0.second);
+    }
+    if (!rqid.empty()) {
+        sz += elementSize(rqidkey, rqid);
+    }
+    for (const auto& it : args) {
+        sz += elementSize(it.first, it.second);
+    }
+    string obuf;
+    obuf.reserve(sz);
     if (!arg0.first.empty()) {
-        obuf << arg0.first << ": " << arg0.second.size() << "\n" << arg0.second;
+        appendElement(obuf, arg0.first, arg0.second);
+    }
+    if (!rqid.empty()) {
+        appendElement(obuf, rqidkey, rqid);
     }
     for (const auto& it : args) {
-        obuf << it.first << ": " << it.second.size() << "\n" << it.second;
+        appendElement(obuf, it.first, it.second);
     }
-    obuf << "\n";
+    obuf += '\n';
 
-    if (cmd->send(obuf.str()) < 0) {
-        cmd->zapChild();
+    std::unique_lock<std::mutex> lock(wmutex);
+    if (cmd->getChildPid() <= 0) {
+	LOGERR("CmdTalk::talk: no process\n");
+        return false;
+    }
+    if (cmd->send(obuf) < 0) {
         LOGERR("CmdTalk: send error\n" );
+        if (version == 2) {
+            cmd->requestChildExit();
+        } else {
+            cmd->zapChild();
+        }
+        return false;
+    }
+    return true;
+}
+
+bool CmdTalk::Internal::talk(const pair<string, string>& arg0,
+			     const unordered_map<string, string>& args,
+			     unordered_map<string, string>& rep)
+{
+    if (version == 2) {
+        std::future<Reply> fut = talkFuture(arg0, args);
+        // The reader has no timeout while waiting for an answer
+        // (there may be none in flight). Do it here.
+        if (fut.wait_for(std::chrono::seconds(m_cancel.m_timeosecs)) !=
+            std::future_status::ready) {
+            LOGINF("CmdTalk::talk: fatal timeout (" << m_cancel.m_timeosecs <<
+                   " S)\n");
+            std::unique_lock<std::mutex> lock(wmutex);
+            cmd->requestChildExit();
+            return false;
+        }
+        Reply reply = fut.get();
+        for (auto& ent : reply.data) {
+            rep[ent.first].swap(ent.second);
+        }
+        return reply.ok;
+    }
+
+    std::unique_lock<std::mutex> lock(mmutex);
+    if (!sendMessage(arg0, args, string())) {
         return false;
     }
 
     // Read answer (multiple elements)
     LOGDEB1("CmdTalk: reading answer\n" );
-    for (;;) {
-        string name, data;
-	if (!readDataElement(name, data)) {
-	    cmd->zapChild();
-	    return false;
-	}
-        if (name.empty()) {
-            break;
-	}
-	trimstring(name, ":");
-	LOGDEB1("CmdTalk: got [" << name << "] -> [" << data << "]\n");
-	rep[name] = data;
+    if (!readMessage(rep)) {
+        cmd->zapChild();
+        return false;
     }
 
     if (rep.find("cmdtalkstatus") != rep.end()) {
@@ -221,11 +343,136 @@ bool CmdTalk::Internal::talk(const pair<string, string>& arg0,
     }
 }
 
+bool CmdTalk::Internal::talkAsync(const pair<string, string>& arg0,
+                                  const unordered_map<string, string>& args,
+                                  ReplyCallback cb)
+{
+    if (version != 2) {
+        unordered_map<string, string> rep;
+        bool ok = talk(arg0, args, rep);
+        cb(ok, rep);
+        return true;
+    }
+
+    unsigned int id;
+    {
+        std::unique_lock<std::mutex> lock(pmutex);
+        id = ++nextid;
+        pending[id] = cb;
+    }
+    if (!sendMessage(arg0, args, ulltodecstr(id))) {
+        std::unique_lock<std::mutex> lock(pmutex);
+        // If the entry is gone, the reader saw the process exit and
+        // already called the callback.
+        return pending.erase(id) == 0;
+    }
+    return true;
+}
+
+std::future<CmdTalk::Reply> CmdTalk::Internal::talkFuture(
+    const pair<string, string>& arg0, const unordered_map<string, string>& args)
+{
+    auto prom = std::make_shared<std::promise<Reply> >();
+    std::future<Reply> fut = prom->get_future();
+    if (!talkAsync(arg0, args,
+                   [prom](bool ok, unordered_map<string, string>& data) {
+                       Reply reply;
+                       reply.ok = ok;
+                       reply.data.swap(data);
+                       prom->set_value(std::move(reply));
+                   })) {
+        prom->set_value(Reply());
+    }
+    return fut;
+}
+
+void CmdTalk::Internal::readerLoop()
+{
+    for (;;) {
+        unordered_map<string, string> rep;
+        if (!readMessage(rep, true)) {
+            break;
+        }
+        auto it = rep.find(rqidkey);
+        if (it == rep.end()) {
+            LOGERR("CmdTalk: answer has no request id\n");
+            continue;
+        }
+        unsigned int id = (unsigned int)atoll(it->second.c_str());
+        rep.erase(it);
+        ReplyCallback cb;
+        {
+            std::unique_lock<std::mutex> lock(pmutex);
+            auto pit = pending.find(id);
+            if (pit != pending.end()) {
+                cb.swap(pit->second);
+                pending.erase(pit);
+            }
+        }
+        if (cb) {
+            cb(rep.find("cmdtalkstatus") == rep.end(), rep);
+        } else {
+            LOGERR("CmdTalk: no request for answer id " << id << endl);
+        }
+    }
+
+    // Read error: the process exited or misbehaved. Reap it and fail
+    // the requests in flight.
+    {
+        std::unique_lock<std::mutex> lock(wmutex);
+        cmd->zapChild();
+    }
+    unordered_map<unsigned int, ReplyCallback> failed;
+    {
+        std::unique_lock<std::mutex> lock(pmutex);
+        failed.swap(pending);
+    }
+    for (auto& ent : failed) {
+        unordered_map<string, string> rep;
+        ent.second(false, rep);
+    }
+    LOGDEB("CmdTalk::readerLoop: exiting\n");
+}
+
+void CmdTalk::Internal::stopReader()
+{
+    if (reader.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(wmutex);
+            cmd->requestChildExit();
+        }
+        reader.join();
+    }
+}
+
 bool CmdTalk::running()
 {
     return m && m->cmd && m->cmd->getChildPid() > 0;
 }
 
+bool CmdTalk::alive()
+{
+    if (!running()) {
+        return false;
+    }
+    if (m->version == 2) {
+        // The reader thread sees the end of file and reaps.
+        return true;
+    }
+    // Version 1: if an exchange is in progress, it will find out by
+    // itself.
+    std::unique_lock<std::mutex> lock(m->mmutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return true;
+    }
+    int status;
+    if (m->cmd->maybereap(&status)) {
+        LOGINF("CmdTalk::alive: command exited, status " << status << "\n");
+        return false;
+    }
+    return true;
+}
+
 bool CmdTalk::talk(const unordered_map<string, string>& args,
 		   unordered_map<string, string>& rep)
 {
@@ -240,4 +487,24 @@ bool CmdTalk::callproc(
     return m->talk({"cmdtalk:proc", proc}, args, rep);
 }
 
+bool CmdTalk::callprocAsync(
+	const string& proc,
+	const unordered_map<std::string, std::string>& args,
+        ReplyCallback cb)
+{
+    return m->talkAsync({"cmdtalk:proc", proc}, args, cb);
+}
+
+std::future<CmdTalk::Reply> CmdTalk::callprocFuture(
+	const string& proc,
+	const unordered_map<std::string, std::string>& args)
+{
+    return m->talkFuture({"cmdtalk:proc", proc}, args);
+}
+
+int CmdTalk::version()
+{
+    return m->version;
+}
+
     
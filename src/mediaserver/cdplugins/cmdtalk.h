@@ -60,8 +60,22 @@ text/plainData: 10
  * The C++ program is the master and sends request messages to the script. 
  * Both sides of the communication should be prepared to receive and discard 
  * unknown tags.
+ *
+ * Protocol version 2:
+ * In the base protocol, there is a single request in flight at any
+ * time: the master waits for the answer before sending the next
+ * request. After starting the command, the master sends a message
+ * with a 'cmdtalk:version' element set to '2'. A script which
+ * supports it answers with the same element and value, and will then
+ * accept new requests while processing the previous ones. Each
+ * request then carries a 'cmdtalk:rqid' element, which is echoed in
+ * the answer, and answers may come in any order. Older scripts
+ * return an error for the version message (no 'cmdtalk:proc'
+ * element), and we stay with version 1.
  */
 
+#include <functional>
+#include <future>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -83,6 +97,11 @@ class CmdTalk {
 			  std::vector<std::string>()
 	);
     virtual bool running();
+
+    // Check that the command did not exit, without exchanging data
+    // with it. The process is reaped if it is gone, and running()
+    // becomes false, so that it can be restarted.
+    virtual bool alive();
     
     // Single exchange: send and receive data.
     virtual bool talk(const std::unordered_map<std::string, std::string>& args,
@@ -95,6 +114,34 @@ class CmdTalk {
 	const std::unordered_map<std::string, std::string>& args,
 	std::unordered_map<std::string, std::string>& rep);
 
+    // Asynchronous interface. The callback is called with the call
+    // status and the answer data, from an internal reader thread,
+    // so it should not block. It is also called (with a false
+    // status) if the command exits before answering. With a version
+    // 1 script, the call is performed synchronously and the callback
+    // is called before returning.
+    // Returns false if the request could not be sent, in which case
+    // the callback is not called.
+    typedef std::function<
+        void(bool, std::unordered_map<std::string, std::string>&)>
+    ReplyCallback;
+    virtual bool callprocAsync(
+	const std::string& proc,
+	const std::unordered_map<std::string, std::string>& args,
+        ReplyCallback cb);
+
+    // Future-returning version of callprocAsync.
+    struct Reply {
+        bool ok{false};
+        std::unordered_map<std::string, std::string> data;
+    };
+    virtual std::future<Reply> callprocFuture(
+	const std::string& proc,
+	const std::unordered_map<std::string, std::string>& args);
+
+    // Negotiated protocol version (1 or 2).
+    virtual int version();
+
     CmdTalk(const CmdTalk&) = delete;
     CmdTalk &operator=(const CmdTalk &) = delete;
 private:
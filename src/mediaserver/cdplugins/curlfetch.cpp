@@ -7,6 +7,7 @@
 
 #include <string>
 #include <mutex>
+#include <atomic>
 
 #include <curl/curl.h>
 
@@ -46,6 +47,7 @@ public:
     size_t curlHeaderCB(void *contents, size_t size, size_t nmemb);
     size_t curlWriteCB(void *contents, size_t size, size_t nmemb);
     int curlSockoptCB(curl_socket_t curlfd, curlsocktype purpose);
+    int curlProgressCB();
 
     CurlFetch *p{nullptr};
     CURL *curl{nullptr};
@@ -57,7 +59,13 @@ public:
     int curl_http_code{200};
 
     // In destructor: any waiting loop must abort asap
-    bool aborting{false}; 
+    std::atomic<bool> aborting{false};
+
+    // Backpressure: the transfer is paused by the write callback when
+    // the output queue is full, and resumed from the progress
+    // callback, which curl keeps calling while paused.
+    std::atomic<bool> paused{false};
+    int pausecnt{0};
     
     // Count of client threads waiting for headers (normally 0/1)
     int extWaitingThreads{0};
@@ -156,6 +164,8 @@ bool CurlFetch::reset()
     m->curldone = false;
     m->curl_code = CURLE_OK;
     m->curl_http_code = 200;
+    m->paused = false;
+    m->pausecnt = 0;
     fetch_data_count = 0;
     outqueue->reset();
     return true;
@@ -182,6 +192,12 @@ bool CurlFetch::fetchDone(FetchStatus *code, int *http_code)
         case CURLE_OK:
             *code = NetFetch::FETCH_OK;
             break;
+        case CURLE_OPERATION_TIMEDOUT:
+            // Older libcurl versions apply the low speed limit to
+            // paused transfers.
+            *code = m->pausecnt ? NetFetch::FETCH_RETRYABLE :
+                NetFetch::FETCH_FATAL;
+            break;
         default:
             *code = NetFetch::FETCH_FATAL;
             break;
@@ -311,6 +327,15 @@ size_t CurlFetch::Internal::curlWriteCB(void *contents, size_t size, size_t cnt)
 {
     size_t bcnt = size * cnt;
 
+    // Consumer too slow: stop reading from the network. curl will
+    // call us again with the same data after we unpause.
+    if (p->datacount() && p->outqueue && p->outqueue->full()) {
+        LOGDEB1("CurlFetch::curlWriteCB: queue full, pausing\n");
+        paused = true;
+        pausecnt++;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
 #ifdef DUMP_CONTENTS
     LOGDEB("CurlWriteCB: bcnt " << bcnt << " headbuf.bytes " <<
            headbuf.bytes << endl);
@@ -355,6 +380,31 @@ size_t CurlFetch::Internal::curlWriteCB(void *contents, size_t size, size_t cnt)
     return p->databufToQ(contents, bcnt);
 }
 
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int curl_xferinfo_cb(void *userp, curl_off_t, curl_off_t,
+                            curl_off_t, curl_off_t)
+#else
+static int curl_progress_cb(void *userp, double, double, double, double)
+#endif
+{
+    CurlFetch::Internal *me = (CurlFetch::Internal *)userp;
+    return me ? me->curlProgressCB() : 1;
+}
+
+int CurlFetch::Internal::curlProgressCB()
+{
+    // Closing the socket does not stop a paused transfer
+    if (aborting) {
+        return 1;
+    }
+    if (paused && p->outqueue && p->outqueue->drained()) {
+        LOGDEB1("CurlFetch::curlProgressCB: resuming\n");
+        paused = false;
+        curl_easy_pause(curl, CURLPAUSE_CONT);
+    }
+    return 0;
+}
+
 static int debug_callback(CURL *curl,
                           curl_infotype type,
                           char *data,
@@ -410,6 +460,14 @@ void CurlFetch::Internal::curlWorkerFunc()
         curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
         curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, curl_sockopt_cb);
         curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, this);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+#if LIBCURL_VERSION_NUM >= 0x072000
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curl_xferinfo_cb);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+#else
+        curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, curl_progress_cb);
+        curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, this);
+#endif
 
         curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15);
         // Speedlimit is in bytes/S. 32Kbits/S
@@ -40,6 +40,9 @@
 //
 // The end of transfer is signalled by pushing an empty buffer on the queue
 //
+// If the queue has a byte budget, the transfer is paused while the
+// queue is full (BufXChange::full()), and resumed when it is drained.
+//
 // All methods are supposedly thread-safe
 class CurlFetch : public NetFetch {
 public:
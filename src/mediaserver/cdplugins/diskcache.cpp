@@ -0,0 +1,426 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "diskcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <set>
+
+#include "libupnpp/log.hxx"
+
+#include "pathut.h"
+#include "readfile.h"
+#include "workqueue.h"
+
+using namespace std;
+
+// File layout:
+//  magic(4) version(u32) expires(i64) key(str) total(u32) count(u32)
+//  entries...
+// Strings are stored as u32 length + bytes.
+static const char diskcachemagic[4] = {'U', 'P', 'D', 'C'};
+static const uint32_t diskcacheversion = 3;
+static const size_t diskcachehdrsize = 16;
+// Interval for the periodic purge.
+static const int diskcachepurgesecs = 3600;
+// When the size limit is exceeded, purge down to this percentage of
+// it, so that the following writes do not each trigger a purge.
+static const int diskcachelowpercent = 80;
+
+class DiskCacheTask {
+public:
+    // Empty path means purge
+    string path;
+    string data;
+};
+
+class DiskCache::Internal {
+public:
+    Internal(const string& d, long long mb)
+        : dir(d), maxbytes(mb), queue("DiskCache") {
+    }
+    string pathForKey(const string& key) {
+        char buf[30];
+        snprintf(buf, sizeof(buf), "%016llx",
+                 (unsigned long long)std::hash<string>()(key));
+        return path_cat(dir, buf);
+    }
+    void purgeFiles();
+    static void *worker(void *);
+
+    string dir;
+    long long maxbytes;
+    WorkQueue<DiskCacheTask*> queue;
+    // Worker thread only: time of the last purge, and current size.
+    time_t lastpurge{0};
+    long long totalbytes{0};
+};
+
+static void putU32(string& out, uint32_t v)
+{
+    out.append((const char *)&v, sizeof(v));
+}
+static void putI64(string& out, int64_t v)
+{
+    out.append((const char *)&v, sizeof(v));
+}
+static void putStr(string& out, const string& s)
+{
+    putU32(out, s.size());
+    out.append(s);
+}
+
+static void putRes(string& out, const UpSong::Res& res)
+{
+    putStr(out, res.uri);
+    putStr(out, res.mime);
+    putU32(out, res.duration_secs);
+    putI64(out, res.size);
+    putU32(out, res.bitrate);
+    putU32(out, res.samplefreq);
+    putU32(out, res.bitsPerSample);
+    putU32(out, res.channels);
+}
+
+// Sequential reader for the serialized data. Any overrun sets the
+// error flag and returns zero values.
+class DiskCacheReader {
+public:
+    DiskCacheReader(const string& d)
+        : data(d) {
+    }
+    bool get(void *out, size_t sz) {
+        if (!ok || data.size() - pos < sz) {
+            ok = false;
+            memset(out, 0, sz);
+            return false;
+        }
+        memcpy(out, data.c_str() + pos, sz);
+        pos += sz;
+        return true;
+    }
+    uint32_t u32() {
+        uint32_t v;
+        get(&v, sizeof(v));
+        return v;
+    }
+    int64_t i64() {
+        int64_t v;
+        get(&v, sizeof(v));
+        return v;
+    }
+    void str(string& s) {
+        uint32_t len = u32();
+        if (!ok || data.size() - pos < len) {
+            ok = false;
+            s.clear();
+            return;
+        }
+        s.assign(data, pos, len);
+        pos += len;
+    }
+    void res(UpSong::Res& res) {
+        str(res.uri);
+        str(res.mime);
+        res.duration_secs = u32();
+        res.size = i64();
+        res.bitrate = u32();
+        res.samplefreq = u32();
+        res.bitsPerSample = u32();
+        res.channels = u32();
+    }
+    // Check magic and version, and return the expiry time, or -1.
+    int64_t header() {
+        char magic[4];
+        get(magic, 4);
+        if (!ok || memcmp(magic, diskcachemagic, 4) ||
+            u32() != diskcacheversion) {
+            return -1;
+        }
+        int64_t expires = i64();
+        return ok ? expires : -1;
+    }
+
+    const string& data;
+    size_t pos{0};
+    bool ok{true};
+};
+
+static void serialize(const string& key, const vector<UpSong>& entries,
+                      int total, int64_t expires, string& out)
+{
+    out.append(diskcachemagic, 4);
+    putU32(out, diskcacheversion);
+    putI64(out, expires);
+    putStr(out, key);
+    putU32(out, uint32_t(total));
+    putU32(out, entries.size());
+    for (const auto& song : entries) {
+        putStr(out, song.id);
+        putStr(out, song.parentid);
+        putStr(out, song.name);
+        putStr(out, song.artist);
+        putStr(out, song.album);
+        putStr(out, song.title);
+        putStr(out, song.tracknum);
+        putStr(out, song.genre);
+        putStr(out, song.artUri);
+        putStr(out, song.upnpClass);
+        putStr(out, song.date);
+        putRes(out, song.rsrc);
+        putU32(out, song.resources.size());
+        for (const auto& res : song.resources) {
+            putRes(out, res);
+        }
+        putU32(out, (song.iscontainer ? 1 : 0) | (song.searchable ? 2 : 0));
+        putU32(out, uint32_t(song.childCount));
+    }
+}
+
+static bool deserialize(const string& key, const string& data,
+                        vector<UpSong>& entries, int& total, int64_t& expires)
+{
+    DiskCacheReader rd(data);
+    expires = rd.header();
+    if (expires < 0 || expires < int64_t(time(0))) {
+        return false;
+    }
+    string fkey;
+    rd.str(fkey);
+    if (!rd.ok || fkey != key) {
+        // Hash collision
+        return false;
+    }
+    total = int(rd.u32());
+    uint32_t cnt = rd.u32();
+    // Sanity check before reserve: an entry needs at least 11 string
+    // lengths.
+    if (!rd.ok || cnt > data.size() / 44) {
+        return false;
+    }
+    entries.clear();
+    entries.reserve(cnt);
+    for (uint32_t i = 0; i < cnt && rd.ok; i++) {
+        UpSong song;
+        rd.str(song.id);
+        rd.str(song.parentid);
+        rd.str(song.name);
+        rd.str(song.artist);
+        rd.str(song.album);
+        rd.str(song.title);
+        rd.str(song.tracknum);
+        rd.str(song.genre);
+        rd.str(song.artUri);
+        rd.str(song.upnpClass);
+        rd.str(song.date);
+        rd.res(song.rsrc);
+        uint32_t nres = rd.u32();
+        for (uint32_t j = 0; j < nres && rd.ok; j++) {
+            UpSong::Res res;
+            rd.res(res);
+            song.resources.push_back(res);
+        }
+        uint32_t flags = rd.u32();
+        song.iscontainer = (flags & 1) != 0;
+        song.searchable = (flags & 2) != 0;
+        song.childCount = int(rd.u32());
+        entries.push_back(song);
+    }
+    if (!rd.ok) {
+        entries.clear();
+        return false;
+    }
+    return true;
+}
+
+void DiskCache::Internal::purgeFiles()
+{
+    string reason;
+    set<string> names;
+    if (!readdir(dir, reason, names)) {
+        LOGERR("DiskCache::purge: can't read " << dir << " : " << reason <<
+               endl);
+        return;
+    }
+    int64_t now = time(0);
+    lastpurge = now;
+    int cnt = 0;
+    struct File {
+        int64_t expires;
+        long long size;
+        string path;
+    };
+    vector<File> files;
+    totalbytes = 0;
+    for (const auto& name : names) {
+        string path = path_cat(dir, name);
+        string data;
+        if (!file_to_string(path, data, 0, diskcachehdrsize)) {
+            continue;
+        }
+        DiskCacheReader rd(data);
+        int64_t expires = rd.header();
+        if (expires < now) {
+            unlink(path.c_str());
+            cnt++;
+        } else {
+            long long size = path_filesize(path);
+            if (size > 0) {
+                files.push_back(File{expires, size, path});
+                totalbytes += size;
+            }
+        }
+    }
+    if (maxbytes > 0 && totalbytes > maxbytes) {
+        long long target = maxbytes / 100 * diskcachelowpercent;
+        std::sort(files.begin(), files.end(),
+                  [](const File& a, const File& b) {
+                      return a.expires < b.expires;});
+        for (const auto& file : files) {
+            if (totalbytes <= target) {
+                break;
+            }
+            unlink(file.path.c_str());
+            totalbytes -= file.size;
+            cnt++;
+        }
+    }
+    LOGDEB("DiskCache::purge: removed " << cnt << " files, size now " <<
+           totalbytes << endl);
+}
+
+void *DiskCache::Internal::worker(void *arg)
+{
+    DiskCache::Internal *m = (DiskCache::Internal *)arg;
+    for (;;) {
+        DiskCacheTask *tsk = nullptr;
+        if (!m->queue.take(&tsk)) {
+            m->queue.workerExit();
+            return (void*)1;
+        }
+        if (tsk->path.empty()) {
+            m->purgeFiles();
+            delete tsk;
+            continue;
+        }
+        string tfn = tsk->path + "-";
+        int fd = open(tfn.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0) {
+            LOGERR("DiskCache: can't open " << tfn << " errno " << errno <<
+                   endl);
+            delete tsk;
+            continue;
+        }
+        bool ok = write(fd, tsk->data.c_str(), tsk->data.size()) ==
+            ssize_t(tsk->data.size());
+        if (close(fd) != 0) {
+            ok = false;
+        }
+        // Size of the file we are replacing, if any
+        long long oldsize = std::max(path_filesize(tsk->path), 0LL);
+        if (!ok || rename(tfn.c_str(), tsk->path.c_str()) != 0) {
+            LOGERR("DiskCache: write/rename failed for " << tsk->path <<
+                   " errno " << errno << endl);
+            unlink(tfn.c_str());
+        } else {
+            m->totalbytes += (long long)tsk->data.size() - oldsize;
+        }
+        delete tsk;
+        if (time(0) - m->lastpurge > diskcachepurgesecs ||
+            (m->maxbytes > 0 && m->totalbytes > m->maxbytes)) {
+            m->purgeFiles();
+        }
+    }
+}
+
+DiskCache::DiskCache(const string& dir, long long maxbytes)
+    : m(new Internal(dir, maxbytes))
+{
+    if (!path_makepath(dir, 0755)) {
+        LOGERR("DiskCache: can't create " << dir << endl);
+        return;
+    }
+    if (!m->queue.start(1, Internal::worker, m)) {
+        LOGERR("DiskCache: could not start worker thread\n");
+        return;
+    }
+    m_ok = true;
+}
+
+DiskCache::~DiskCache()
+{
+    m->queue.setTerminateAndWait();
+    delete m;
+}
+
+bool DiskCache::get(const string& key, vector<UpSong>& entries,
+                    int& total, time_t *expires)
+{
+    if (!m_ok) {
+        return false;
+    }
+    string path = m->pathForKey(key);
+    string data;
+    if (!file_to_string(path, data)) {
+        return false;
+    }
+    int64_t exp;
+    if (!deserialize(key, data, entries, total, exp)) {
+        LOGDEB0("DiskCache::get: " << key << " expired or bad\n");
+        return false;
+    }
+    if (expires) {
+        *expires = time_t(exp);
+    }
+    LOGDEB0("DiskCache::get: found " << key << endl);
+    return true;
+}
+
+void DiskCache::put(const string& key, const vector<UpSong>& entries,
+                    int total, int ttlsecs)
+{
+    if (!m_ok) {
+        return;
+    }
+    DiskCacheTask *tsk = new DiskCacheTask;
+    tsk->path = m->pathForKey(key);
+    serialize(key, entries, total, int64_t(time(0)) + ttlsecs, tsk->data);
+    if (!m->queue.put(tsk)) {
+        delete tsk;
+    }
+}
+
+void DiskCache::purge()
+{
+    if (!m_ok) {
+        return;
+    }
+    DiskCacheTask *tsk = new DiskCacheTask;
+    if (!m->queue.put(tsk)) {
+        LOGERR("DiskCache::purge: can't queue task\n");
+        delete tsk;
+    }
+}
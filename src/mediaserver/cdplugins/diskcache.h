@@ -0,0 +1,72 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DISKCACHE_H_INCLUDED_
+#define _DISKCACHE_H_INCLUDED_
+
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "upmpdutils.hxx"
+
+//
+// Disk storage for plugin browse/search results, used as a second
+// tier behind the memory caches, so that the results survive restarts
+// and memory cache expiry.
+//
+// Each result list is stored in its own file, in a compact binary
+// format (native byte order: this is a local cache), along with its
+// key and expiry time. The file name is derived from a hash of the
+// key. Writes and purges are performed by a worker thread.
+class DiskCache {
+public:
+    /// @param dir storage directory, created if needed.
+    /// @param maxbytes size limit for the stored data, 0 for none.
+    DiskCache(const std::string& dir, long long maxbytes);
+    ~DiskCache();
+
+    bool ok() const {
+        return m_ok;
+    }
+
+    /// Retrieve entries. Returns false if not found or expired.
+    /// @param[out] total the value stored with the entries.
+    /// @param[out] expires if not null, set to the expiry time.
+    bool get(const std::string& key, std::vector<UpSong>& entries,
+             int& total, time_t *expires = nullptr);
+
+    /// Store entries, to be kept for ttlsecs.
+    /// @param total full list size if entries is a window from a
+    ///    paging slave, else -1.
+    void put(const std::string& key, const std::vector<UpSong>& entries,
+             int total, int ttlsecs);
+
+    /// Remove the expired files, then the ones closest to expiry if
+    /// the size limit is exceeded. This is queued to the worker
+    /// thread, which also does it periodically, and when the size
+    /// limit is reached.
+    void purge();
+
+    class Internal;
+private:
+    Internal *m{nullptr};
+    bool m_ok{false};
+};
+
+#endif /* _DISKCACHE_H_INCLUDED_ */
@@ -0,0 +1,423 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "jsonentries.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <unordered_map>
+
+#include "libupnpp/log.hxx"
+
+#include "smallut.h"
+
+using namespace std;
+
+// The keys we use. The values are stored in a fixed array while
+// scanning an object, and converted when it ends, because the
+// interpretation depends on the entry type, which may come last.
+enum EntryKey {
+    EK_id, EK_pid, EK_tt, EK_arturi, EK_artist, EK_class, EK_date,
+    EK_releasedate, EK_tp, EK_searchable, EK_uri, EK_creator, EK_genre,
+    EK_album, EK_tracknum, EK_mime, EK_duration, EK_size, EK_bitrate,
+    EK_samplefreq, EK_bitspersample, EK_channels, EK_childcount,
+    EK_count
+};
+
+static const unordered_map<string, int> keytable {
+    {"id", EK_id},
+    {"pid", EK_pid},
+    {"tt", EK_tt},
+    {"upnp:albumArtURI", EK_arturi},
+    {"upnp:artist", EK_artist},
+    {"upnp:class", EK_class},
+    {"dc:date", EK_date},
+    {"releasedate", EK_releasedate},
+    {"tp", EK_tp},
+    {"searchable", EK_searchable},
+    {"uri", EK_uri},
+    {"dc:creator", EK_creator},
+    {"upnp:genre", EK_genre},
+    {"upnp:album", EK_album},
+    {"upnp:originalTrackNumber", EK_tracknum},
+    {"res:mime", EK_mime},
+    {"duration", EK_duration},
+    {"res:size", EK_size},
+    {"res:bitrate", EK_bitrate},
+    {"res:samplefreq", EK_samplefreq},
+    {"res:bitsPerSample", EK_bitspersample},
+    {"res:channels", EK_channels},
+    {"childcount", EK_childcount},
+};
+
+static void catstring(string& dest, const string& s2)
+{
+    if (s2.empty()) {
+        return;
+    }
+    if (dest.empty()) {
+        dest = s2;
+    } else {
+        dest += string(" ") + s2;
+    }
+}
+
+static void appendUtf8(string& out, unsigned int c)
+{
+    if (c < 0x80) {
+        out += char(c);
+    } else if (c < 0x800) {
+        out += char(0xc0 | (c >> 6));
+        out += char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += char(0xe0 | (c >> 12));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    } else {
+        out += char(0xf0 | (c >> 18));
+        out += char(0x80 | ((c >> 12) & 0x3f));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    }
+}
+
+class JsonScanner {
+public:
+    JsonScanner(const string& s)
+        : m_cp(s.c_str()), m_end(s.c_str() + s.size()) {
+    }
+
+    void skipws() {
+        while (m_cp < m_end &&
+               (*m_cp == ' ' || *m_cp == '\t' || *m_cp == '\n' ||
+                *m_cp == '\r')) {
+            m_cp++;
+        }
+    }
+    // Skip white space and consume c if it is next.
+    bool accept(char c) {
+        skipws();
+        if (m_cp < m_end && *m_cp == c) {
+            m_cp++;
+            return true;
+        }
+        return false;
+    }
+
+    // Decode a string value. out may be null to just skip it.
+    bool str(string *out) {
+        if (!accept('"')) {
+            return false;
+        }
+        for (;;) {
+            // Copy the plain text up to the next quote or escape in
+            // one go.
+            const char *cp = m_cp;
+            while (cp < m_end && *cp != '"' && *cp != '\\') {
+                cp++;
+            }
+            if (cp == m_end) {
+                return false;
+            }
+            if (out) {
+                out->append(m_cp, cp - m_cp);
+            }
+            m_cp = cp + 1;
+            if (*cp == '"') {
+                return true;
+            }
+            if (!escape(out)) {
+                return false;
+            }
+        }
+    }
+
+    // Scalar value as text, the way jsoncpp asString() would return
+    // it. Arrays and objects are skipped and yield an empty value.
+    bool scalar(string& out) {
+        out.clear();
+        skipws();
+        if (m_cp == m_end) {
+            return false;
+        }
+        switch (*m_cp) {
+        case '"':
+            return str(&out);
+        case '{': case '[':
+            return skipValue();
+        case 'n':
+            return literal("null");
+        default: {
+            const char *cp = m_cp;
+            while (m_cp < m_end && (isalnum((unsigned char)*m_cp) ||
+                                    *m_cp == '-' || *m_cp == '+' ||
+                                    *m_cp == '.')) {
+                m_cp++;
+            }
+            out.assign(cp, m_cp - cp);
+            return !out.empty();
+        }
+        }
+    }
+
+    // Skip any value, without decoding it.
+    bool skipValue() {
+        skipws();
+        if (m_cp == m_end) {
+            return false;
+        }
+        if (*m_cp == '"') {
+            return str(nullptr);
+        }
+        if (*m_cp != '{' && *m_cp != '[') {
+            while (m_cp < m_end && *m_cp != ',' && *m_cp != '}' &&
+                   *m_cp != ']' && *m_cp != ' ' && *m_cp != '\n' &&
+                   *m_cp != '\t' && *m_cp != '\r') {
+                m_cp++;
+            }
+            return true;
+        }
+        // Compound: just track the nesting, skipping the strings
+        int depth = 0;
+        while (m_cp < m_end) {
+            switch (*m_cp) {
+            case '"':
+                if (!str(nullptr)) {
+                    return false;
+                }
+                continue;
+            case '{': case '[':
+                depth++;
+                break;
+            case '}': case ']':
+                if (--depth == 0) {
+                    m_cp++;
+                    return true;
+                }
+                break;
+            }
+            m_cp++;
+        }
+        return false;
+    }
+
+private:
+    bool literal(const char *lit) {
+        size_t len = strlen(lit);
+        if (size_t(m_end - m_cp) < len || memcmp(m_cp, lit, len)) {
+            return false;
+        }
+        m_cp += len;
+        return true;
+    }
+
+    bool hex4(unsigned int& c) {
+        if (m_end - m_cp < 4) {
+            return false;
+        }
+        char buf[5];
+        memcpy(buf, m_cp, 4);
+        buf[4] = 0;
+        char *endp;
+        c = (unsigned int)strtoul(buf, &endp, 16);
+        m_cp += 4;
+        return endp == buf + 4;
+    }
+
+    // Called after a backslash.
+    bool escape(string *out) {
+        if (m_cp == m_end) {
+            return false;
+        }
+        char c = *m_cp++;
+        if (c == 'u') {
+            unsigned int uc;
+            if (!hex4(uc)) {
+                return false;
+            }
+            // Python's json.dumps() escapes all non-ASCII, with
+            // surrogate pairs for the characters outside of the BMP.
+            if (uc >= 0xd800 && uc < 0xdc00 && m_end - m_cp >= 6 &&
+                m_cp[0] == '\\' && m_cp[1] == 'u') {
+                m_cp += 2;
+                unsigned int lc;
+                if (!hex4(lc)) {
+                    return false;
+                }
+                if (lc >= 0xdc00 && lc < 0xe000) {
+                    uc = 0x10000 + ((uc - 0xd800) << 10) + (lc - 0xdc00);
+                }
+            }
+            if (out) {
+                appendUtf8(*out, uc);
+            }
+            return true;
+        }
+        if (out) {
+            switch (c) {
+            case 'b': *out += '\b'; break;
+            case 'f': *out += '\f'; break;
+            case 'n': *out += '\n'; break;
+            case 'r': *out += '\r'; break;
+            case 't': *out += '\t'; break;
+            default: *out += c; break;
+            }
+        }
+        return true;
+    }
+
+    const char *m_cp;
+    const char *m_end;
+};
+
+// Same conversions as the previous Json::Value-based code.
+static bool valuesToSong(string *vals, UpSong& song)
+{
+    catstring(song.id, vals[EK_id]);
+    catstring(song.parentid, vals[EK_pid]);
+    catstring(song.title, vals[EK_tt]);
+    catstring(song.artUri, vals[EK_arturi]);
+    catstring(song.artist, vals[EK_artist]);
+    catstring(song.upnpClass, vals[EK_class]);
+    catstring(song.date, vals[EK_date]);
+    catstring(song.date, vals[EK_releasedate]);
+    // tp is container ("ct") or item ("it")
+    const string& stp = vals[EK_tp];
+    if (!stp.compare("ct")) {
+        song.iscontainer = true;
+        if (!vals[EK_searchable].empty()) {
+            song.searchable = stringToBool(vals[EK_searchable]);
+        }
+        if (!vals[EK_childcount].empty()) {
+            song.childCount = atoi(vals[EK_childcount].c_str());
+        }
+    } else if (!stp.compare("it")) {
+        song.iscontainer = false;
+        catstring(song.rsrc.uri, vals[EK_uri]);
+        catstring(song.artist, vals[EK_creator]);
+        catstring(song.genre, vals[EK_genre]);
+        catstring(song.album, vals[EK_album]);
+        catstring(song.tracknum, vals[EK_tracknum]);
+        catstring(song.rsrc.mime, vals[EK_mime]);
+        if (!vals[EK_duration].empty()) {
+            song.rsrc.duration_secs = atoi(vals[EK_duration].c_str());
+        }
+        if (!vals[EK_size].empty()) {
+            song.rsrc.size = atoll(vals[EK_size].c_str());
+        }
+        if (!vals[EK_bitrate].empty()) {
+            song.rsrc.bitrate = atoi(vals[EK_bitrate].c_str());
+        }
+        if (!vals[EK_samplefreq].empty()) {
+            song.rsrc.samplefreq = atoi(vals[EK_samplefreq].c_str());
+        }
+        if (!vals[EK_bitspersample].empty()) {
+            song.rsrc.bitsPerSample = atoi(vals[EK_bitspersample].c_str());
+        }
+        if (!vals[EK_channels].empty()) {
+            song.rsrc.channels = atoi(vals[EK_channels].c_str());
+        }
+    } else {
+        LOGERR("jsonToEntries: bad type in entry: " << stp <<
+               "(title: " << song.title << ")\n");
+        return false;
+    }
+    return true;
+}
+
+// Decode one object. The key and values buffers are reused across
+// entries to avoid reallocations.
+static bool decodeEntry(JsonScanner& scan, string& key, string *vals,
+                        vector<UpSong>& entries)
+{
+    for (int i = 0; i < EK_count; i++) {
+        vals[i].clear();
+    }
+    if (!scan.accept('{')) {
+        // Not an object: skip it.
+        LOGERR("jsonToEntries: array element is not an object\n");
+        return scan.skipValue();
+    }
+    if (!scan.accept('}')) {
+        for (;;) {
+            key.clear();
+            if (!scan.str(&key) || !scan.accept(':')) {
+                return false;
+            }
+            auto it = keytable.find(key);
+            if (it == keytable.end()) {
+                if (!scan.skipValue()) {
+                    return false;
+                }
+            } else if (!scan.scalar(vals[it->second])) {
+                return false;
+            }
+            if (scan.accept(',')) {
+                continue;
+            }
+            if (scan.accept('}')) {
+                break;
+            }
+            return false;
+        }
+    }
+    UpSong song;
+    if (valuesToSong(vals, song)) {
+        LOGDEB1("jsonToEntries: pushing: " << song.dump() << endl);
+        entries.push_back(std::move(song));
+    }
+    return true;
+}
+
+int jsonToEntries(const string& json, int stidx, int cnt,
+                  vector<UpSong>& entries)
+{
+    JsonScanner scan(json);
+    if (!scan.accept('[')) {
+        LOGERR("jsonToEntries: data is not an array\n");
+        return -1;
+    }
+    int idx = 0;
+    if (!scan.accept(']')) {
+        string key;
+        string vals[EK_count];
+        for (;; idx++) {
+            bool ok;
+            if (idx >= stidx && (cnt <= 0 || idx < stidx + cnt)) {
+                ok = decodeEntry(scan, key, vals, entries);
+            } else {
+                ok = scan.skipValue();
+            }
+            if (!ok) {
+                LOGERR("jsonToEntries: syntax error in entry " << idx << endl);
+                return -1;
+            }
+            if (scan.accept(',')) {
+                continue;
+            }
+            if (scan.accept(']')) {
+                idx++;
+                break;
+            }
+            LOGERR("jsonToEntries: syntax error after entry " << idx << endl);
+            return -1;
+        }
+    }
+    LOGDEB0("jsonToEntries: got " << idx << " entries\n");
+    return idx;
+}
@@ -0,0 +1,45 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _JSONENTRIES_H_INCLUDED_
+#define _JSONENTRIES_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+#include "upmpdutils.hxx"
+
+//
+// Decoding of the browse/search results produced by the plugin
+// slaves: a JSON array of objects with string values, using a fixed
+// set of keys (see upmplgutils.py).
+//
+// This is a single pass scanner which fills the UpSong fields
+// directly, without building a document tree. Entries outside of the
+// requested window are skipped without decoding, and unknown keys are
+// ignored.
+//
+// @param json the slave data.
+// @param stidx index of the first entry to convert.
+// @param cnt max number of entries to convert. 0 for all.
+// @param[out] entries the converted entries are appended.
+// @return the total number of entries in the array, or -1 for a
+//   syntax error.
+extern int jsonToEntries(const std::string& json, int stidx, int cnt,
+                         std::vector<UpSong>& entries);
+
+#endif /* _JSONENTRIES_H_INCLUDED_ */
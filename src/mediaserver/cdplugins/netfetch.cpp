@@ -28,10 +28,35 @@ using namespace std;
 #define MAX(A,B) ((A) < (B) ? (B) : (A))
 #endif
 
+// Size of the data queue buffers. Network reads are usually
+// smaller, and, when the consumer is slower than the network, they
+// are accumulated in the last queued buffer, so that the consumer
+// gets big blocks and we don't allocate and queue a buffer for each
+// read.
+static const size_t qbufsize(64 * 1024);
+
 size_t NetFetch::databufToQ(const void *contents, size_t bcnt)
 {
     LOGDEB1("NetFetch::dataBufToQ. bcnt " << bcnt << endl);
-    
+
+    // An empty buffer marks the end of stream, never append to it
+    // (or append nothing to a data one).
+    if (bcnt && outqueue &&
+        outqueue->modifyback([contents, bcnt](ABuffer*& buf) {
+                if (buf->bytes == 0 || buf->allocbytes - buf->bytes < bcnt) {
+                    return false;
+                }
+                memcpy(buf->buf + buf->bytes, contents, bcnt);
+                buf->bytes += bcnt;
+                return true;
+            })) {
+        fetch_data_count += bcnt;
+        if (fbcb) {
+            fbcb(fetch_data_count);
+        }
+        return bcnt;
+    }
+
     ABuffer *buf = nullptr;
     // Try to recover an empty buffer from the queue, else allocate one.
     if (outqueue && outqueue->take_recycled(&buf)) {
@@ -41,7 +66,7 @@ size_t NetFetch::databufToQ(const void *contents, size_t bcnt)
         }
     }
     if (buf == nullptr) {
-        buf = new ABuffer(MAX(4096, bcnt));
+        buf = new ABuffer(MAX(qbufsize, bcnt));
     }
     if (buf == nullptr) {
         LOGERR("CurlFetch::dataBufToQ: can't get buffer for " << bcnt <<
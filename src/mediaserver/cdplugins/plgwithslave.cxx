@@ -18,16 +18,21 @@
 
 #include "plgwithslave.hxx"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <sstream>
 #include <functional>
+#include <atomic>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
 
 #include <string.h>
 #include <fcntl.h>
 #include <upnp/upnp.h>
-#include <json/json.h>
 #include <libupnpp/log.hxx>
 
 #include "cmdtalk.h"
@@ -39,6 +44,10 @@
 #include "streamproxy.h"
 #include "netfetch.h"
 #include "curlfetch.h"
+#include "diskcache.h"
+#include "jsonentries.h"
+#include "sortentries.h"
+#include "workqueue.h"
 
 #ifdef ENABLE_SPOTIFY
 #include "spotify/spotiproxy.h"
@@ -49,42 +58,67 @@ using namespace std::placeholders;
 //using json = nlohmann::json;
 using namespace UPnPProvider;
 
-class StreamHandle {
+// Cached media URL translation. While the slave call is running,
+// expires is 0, and other requests for the same path wait on the
+// shared future instead of calling the slave again.
+class MediaUrlEntry {
 public:
-    StreamHandle(PlgWithSlave::Internal *plg) {
-    }
-    ~StreamHandle() {
-        clear();
-    }
-    void clear() {
-        plg = 0;
-        path.clear();
-        media_url.clear();
-        len = 0;
-        opentime = 0;
-    }
-    
-    PlgWithSlave::Internal *plg;
-    string path;
-    string media_url;
-    long long len;
-    time_t opentime;
+    std::shared_future<string> url;
+    time_t expires{0};
 };
 
+// Max entries in the media URL cache.
+static const size_t mediaurlcachesize(200);
+
 // Timeout seconds for reading data from plugins. Be generous because
 // streaming services are sometimes slow, but we don't want to be
 // stuck forever.
 static const int read_timeout(60);
 
+// A slave process, and the count of requests using or waiting for it.
+class SlaveProc {
+public:
+    SlaveProc()
+        : cmd(read_timeout) {
+    }
+    CmdTalk cmd;
+    std::atomic<int> busy{0};
+    std::mutex startmutex;
+};
+
+// Max slave processes per plugin
+static const int maxslaves(8);
+
 class PlgWithSlave::Internal {
 public:
     Internal(PlgWithSlave *_plg)
-        : plg(_plg), cmd(read_timeout), laststream(this) {
+        : plg(_plg) {
 
         string val;
         if (g_config->get("plgproxymethod", val) && !val.compare("proxy")) {
             doingproxy = true;
         }
+        // The uprcl slave runs the media HTTP server and owns the
+        // index: there can be only one.
+        int nslaves = 1;
+        if (plg->getname().compare("uprcl")) {
+            if (g_config->get(plg->getname() + "slaves", val) ||
+                g_config->get("plgslaves", val)) {
+                nslaves = atoi(val.c_str());
+            }
+            nslaves = std::max(1, std::min(nslaves, maxslaves));
+        }
+        for (int i = 0; i < nslaves; i++) {
+            slaves.push_back(std::unique_ptr<SlaveProc>(new SlaveProc));
+        }
+        // Validity of the service media URLs
+        if (g_config->get(plg->getname() + "urlttl", val) ||
+            g_config->get("plgurlttl", val)) {
+            urlttl = atoi(val.c_str());
+        }
+        if (!plg->getname().compare("uprcl")) {
+            setFileRoots();
+        }
 #ifdef ENABLE_SPOTIFY
         if (!plg->getname().compare("spotify")) {
             g_config->get("spotifyuser", user);
@@ -101,20 +135,67 @@ public:
     bool doproxy() {
         return doingproxy;
     }
-    bool maybeStartCmd();
+    bool maybeStartCmd() {
+        return maybeStartCmd(*slaves[0]);
+    }
+    bool maybeStartCmd(SlaveProc& slave);
+    void setFileRoots();
+    // Call a slave method. Priority calls (track URL translations)
+    // never wait behind browse/search calls if we have several slaves.
+    bool callproc(bool priority, const string& proc,
+                  const unordered_map<string, string>& args,
+                  unordered_map<string, string>& res);
 
     PlgWithSlave *plg;
-    CmdTalk cmd;
+    vector<std::unique_ptr<SlaveProc> > slaves;
     bool doingproxy{false};
 
+    // Does the slave support returning a window of the browse/search
+    // results? We find out from the first reply.
+    enum Paging {PagingUnknown, PagingYes, PagingNo};
+    std::atomic<int> paging{PagingUnknown};
+
+    // Incremented for each foreground request. Queued prefetch
+    // tasks with an older value are dropped.
+    std::atomic<unsigned int> fggen{0};
+
     // This is only used by spotify (also needs login in the c++
     // streamer in addition to python). We could create a derived
     // class, but seems simpler this way.
     string user;
     string password;
     
-    // Cached uri translation
-    StreamHandle laststream;
+    // Cached uri translations, by path.
+    int urlttl{10};
+    std::mutex urlmutex;
+    unordered_map<string, std::shared_ptr<MediaUrlEntry> > urlcache;
+
+    // Content generation, as reported by the slave (e.g. uprcl index
+    // update time). This is part of the cache keys, so that a change
+    // makes the cached data unreachable.
+    std::mutex updmutex;
+    string updateid;
+    string cacheprefix() {
+        std::unique_lock<std::mutex> lock(updmutex);
+        return updateid.empty() ? plg->m_name :
+            plg->m_name + "#" + updateid;
+    }
+    // Cache key prefix for the data in a slave reply: this uses the
+    // reply's own update id, which may be newer than the one the
+    // request was looked up with.
+    string cacheprefix(const unordered_map<string, string>& res) {
+        auto it = res.find("updateid");
+        if (it == res.end()) {
+            return cacheprefix();
+        }
+        return it->second.empty() ? plg->m_name :
+            plg->m_name + "#" + it->second;
+    }
+    void checkUpdateId(const unordered_map<string, string>& res);
+
+    // uprcl: real media directories, if we serve the track files
+    // directly. Empty otherwise.
+    vector<string> fileroots;
 };
 
 // HTTP Proxy/Redirect handler
@@ -148,6 +229,13 @@ StreamProxy::UrlTransReturn translateurl(
         path += string("?version=1&trackId=") + it->second;
     }
 
+    // Local file (uprcl): no need to call the slave.
+    string fpath;
+    if (realplg->get_local_path(url, fpath)) {
+        url = fpath;
+        return StreamProxy::LocalFile;
+    }
+
     // Translate to Tidal/Qobuz etc real temporary URL
     url = realplg->get_media_url(path);
     if (url.empty()) {
@@ -166,6 +254,17 @@ StreamProxy::UrlTransReturn translateurl(
 #endif
         } else {
             fetcher = std::move(std::unique_ptr<NetFetch>(new CurlFetch(url)));
+            // Forget the cached translation if the service says that
+            // the URL is not valid any more. The fetcher outlives
+            // its worker thread, which calls us.
+            NetFetch *nf = fetcher.get();
+            fetcher->setEOFetchCB([realplg, path, nf](bool, uint64_t) {
+                    int httpcode = 0;
+                    if (nf->fetchDone(nullptr, &httpcode) &&
+                        (httpcode == 403 || httpcode == 410)) {
+                        realplg->invalidate_media_url(path);
+                    }
+                });
         }
     }
     return method;
@@ -188,12 +287,19 @@ bool PlgWithSlave::startPluginCmd(CmdTalk& cmd, const string& appname,
     ss << host << ":" << port;
     string hostport = string("UPMPD_HTTPHOSTPORT=") + ss.str();
     string pp = string("UPMPD_PATHPREFIX=") + pathpref;
+    // Concurrent requests inside the slave (cmdtalk protocol version 2)
+    string nthreads("1");
+    if (!g_config->get(appname + "slavethreads", nthreads)) {
+        g_config->get("plgslavethreads", nthreads);
+    }
+    string threads = string("UPMPD_SLAVETHREADS=") + nthreads;
     string exepath = path_cat(g_datadir, "cdplugins");
     exepath = path_cat(exepath, appname);
     exepath = path_cat(exepath, appname + "-app" + ".py");
 
     if (!cmd.startCmd(exepath, {/*args*/},
-                      /* env */ {pythonpath, configname, hostport, pp})) {
+                      /* env */ {pythonpath, configname, hostport, pp,
+                          threads})) {
         LOGERR("PlgWithSlave::maybeStartCmd: startCmd failed\n");
         return false;
     }
@@ -215,14 +321,27 @@ bool PlgWithSlave::maybeStartProxy(CDPluginServices *cdsrv)
             LOGERR("PlgWithSlave: Proxy creation failed\n");
             return false;
         }
+        size_t streammb = 8;
+        size_t totalmb = 32;
+        string val;
+        if (g_config && g_config->get("plgproxystreammb", val)) {
+            streammb = atoi(val.c_str());
+        }
+        if (g_config && g_config->get("plgproxytotalmb", val)) {
+            totalmb = atoi(val.c_str());
+        }
+        o_proxy->setBufferBudget(streammb * 1024 * 1024,
+                                 totalmb * 1024 * 1024);
     }
     return true;
 }
 
 // Called once for starting the Python program and do other initialization.
-bool PlgWithSlave::Internal::maybeStartCmd()
+bool PlgWithSlave::Internal::maybeStartCmd(SlaveProc& slave)
 {
-    if (cmd.running()) {
+    std::unique_lock<std::mutex> lock(slave.startmutex);
+    CmdTalk& cmd = slave.cmd;
+    if (cmd.alive()) {
         LOGDEB1("PlgWithSlave::maybeStartCmd: already running\n");
         return true;
     }
@@ -230,6 +349,9 @@ bool PlgWithSlave::Internal::maybeStartCmd()
         LOGDEB1("PlgWithSlave::maybeStartCmd: maybeStartMHD failed\n");
         return false;
     }
+    for (const auto& dir : fileroots) {
+        o_proxy->addFileRoot(dir);
+    }
     if (!startPluginCmd(cmd, plg->m_name,
                         plg->m_services->microhttphost(),
                         plg->m_services->microhttpport(),
@@ -264,9 +386,76 @@ bool PlgWithSlave::Internal::maybeStartCmd()
     return true;
 }
 
+bool PlgWithSlave::Internal::callproc(
+    bool priority, const string& proc,
+    const unordered_map<string, string>& args,
+    unordered_map<string, string>& res)
+{
+    // Least busy slave. With several slaves, the first one is
+    // reserved for priority calls.
+    size_t first = (slaves.size() > 1 && !priority) ? 1 : 0;
+    SlaveProc *slave = nullptr;
+    for (size_t i = first; i < slaves.size(); i++) {
+        if (nullptr == slave || slaves[i]->busy < slave->busy) {
+            slave = slaves[i].get();
+        }
+    }
+    slave->busy++;
+    bool ret = maybeStartCmd(*slave) && slave->cmd.callproc(proc, args, res);
+    slave->busy--;
+    if (ret) {
+        checkUpdateId(res);
+    }
+    return ret;
+}
+
+// Slaves with changing content return an "updateid" value with their
+// results. Signal the changes to the ContentDirectory. The first value
+// we see is not a change: we know nothing of the previous state.
+void PlgWithSlave::Internal::checkUpdateId(
+    const unordered_map<string, string>& res)
+{
+    auto it = res.find("updateid");
+    if (it == res.end()) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(updmutex);
+        if (it->second == updateid) {
+            return;
+        }
+        bool first = updateid.empty();
+        updateid = it->second;
+        if (first) {
+            return;
+        }
+    }
+    LOGINF("PlgWithSlave: " << plg->m_name << ": content changed\n");
+    plg->m_services->contentChanged(string("0$") + plg->m_name + "$");
+}
+
+// Start all the slave processes, or restart the ones which exited.
+// This is called at startup for the pre-started plugins, then
+// periodically. Busy slaves are left alone: their exchange will
+// detect a problem.
 bool PlgWithSlave::startInit()
 {
-    return m && m->maybeStartCmd();
+    if (nullptr == m) {
+        return false;
+    }
+    bool ok = true;
+    for (auto& slave : m->slaves) {
+        if (slave->busy) {
+            continue;
+        }
+        // Make callproc() choose another slave while we restart
+        slave->busy++;
+        if (!m->maybeStartCmd(*slave)) {
+            ok = false;
+        }
+        slave->busy--;
+    }
+    return ok;
 }
 
 // Translate the slave-generated HTTP URL (based on the trackid), to
@@ -281,31 +470,127 @@ bool PlgWithSlave::startInit()
 string PlgWithSlave::get_media_url(const string& path)
 {
     LOGDEB0("PlgWithSlave::get_media_url: " << path << endl);
+    m->fggen++;
     if (!m->maybeStartCmd()) {
         return string();
     }
-    time_t now = time(0);
-    if (m->laststream.path.compare(path) ||
-        (now - m->laststream.opentime > 10)) {
-        unordered_map<string, string> res;
-        if (!m->cmd.callproc("trackuri", {{"path", path}}, res)) {
-            LOGERR("PlgWithSlave::get_media_url: slave failure\n");
-            return string();
+
+    std::shared_ptr<MediaUrlEntry> entry;
+    std::promise<string> promise;
+    {
+        std::unique_lock<std::mutex> lock(m->urlmutex);
+        time_t now = time(0);
+        auto it = m->urlcache.find(path);
+        if (it != m->urlcache.end() &&
+            (it->second->expires == 0 || it->second->expires > now)) {
+            entry = it->second;
+            lock.unlock();
+            string url = entry->url.get();
+            LOGDEB("PlgWithSlave: cached media url [" << url << "]\n");
+            return url;
+        }
+        if (m->urlcache.size() >= mediaurlcachesize) {
+            for (auto it = m->urlcache.begin(); it != m->urlcache.end();) {
+                if (it->second->expires != 0 && it->second->expires <= now) {
+                    it = m->urlcache.erase(it);
+                } else {
+                    it++;
+                }
+            }
         }
+        entry = std::make_shared<MediaUrlEntry>();
+        entry->url = promise.get_future().share();
+        m->urlcache[path] = entry;
+    }
 
+    string url;
+    unordered_map<string, string> res;
+    if (!m->callproc(true, "trackuri", {{"path", path}}, res)) {
+        LOGERR("PlgWithSlave::get_media_url: slave failure\n");
+    } else {
         auto it = res.find("media_url");
         if (it == res.end()) {
             LOGERR("PlgWithSlave::get_media_url: no media url in result\n");
-            return string();
+        } else {
+            url = it->second;
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m->urlmutex);
+        auto it = m->urlcache.find(path);
+        if (url.empty() || m->urlttl <= 0) {
+            if (it != m->urlcache.end() && it->second == entry) {
+                m->urlcache.erase(it);
+            }
+        } else {
+            entry->expires = time(0) + m->urlttl;
+        }
+    }
+    promise.set_value(url);
+    LOGDEB("PlgWithSlave: media url [" << url << "]\n");
+    return url;
+}
+
+// The uprcl track files are served by the microhttpd server, unless
+// uprclnativestream is false. The files must be inside the real
+// directories from the "urlpath:realpath" uprclpaths pairs, or inside
+// the uprclmediadirs. If neither is set (directories from the Minim
+// configuration), the Python server is used. uprclinit.py decides
+// which URLs to generate with the same rules.
+void PlgWithSlave::Internal::setFileRoots()
+{
+    string val;
+    if (g_config->get("uprclnativestream", val) && !stringToBool(val)) {
+        return;
+    }
+    if (g_config->get("uprclpaths", val) && !val.empty()) {
+        vector<string> pairs;
+        stringToTokens(val, pairs, ",");
+        for (const auto& pr : pairs) {
+            vector<string> elts;
+            stringToTokens(pr, elts, ":");
+            if (elts.size() == 2) {
+                fileroots.push_back(path_canon(elts[1]));
+            }
         }
-        m->laststream.clear();
-        m->laststream.path = path;
-        m->laststream.media_url = it->second;
-        m->laststream.opentime = now;
+    } else if (g_config->get("uprclmediadirs", val) && !val.empty()) {
+        vector<string> dirs;
+        stringToStrings(val, dirs);
+        for (const auto& dir : dirs) {
+            fileroots.push_back(path_canon(dir));
+        }
+    }
+    if (fileroots.empty()) {
+        LOGINF("PlgWithSlave: uprcl: streams served by the Python server\n");
+    }
+}
+
+// The URL path is the plugin path prefix followed by the real file
+// path (uprclutils.rcldoctoentry()). The proxy checks that the file
+// really is inside one of the media directories (after resolving
+// links).
+bool PlgWithSlave::get_local_path(const string& urlpath, string& fpath)
+{
+    if (m->fileroots.empty()) {
+        return false;
+    }
+    string prefix = CDPluginServices::getpathprefix(this);
+    if (urlpath.compare(0, prefix.size(), prefix)) {
+        return false;
     }
+    fpath = path_canon(urlpath.substr(prefix.size()));
+    return true;
+}
 
-    LOGDEB("PlgWithSlave: media url [" << m->laststream.media_url << "]\n");
-    return m->laststream.media_url;
+void PlgWithSlave::invalidate_media_url(const string& path)
+{
+    std::unique_lock<std::mutex> lock(m->urlmutex);
+    auto it = m->urlcache.find(path);
+    if (it != m->urlcache.end() && it->second->expires != 0) {
+        LOGDEB("PlgWithSlave::invalidate_media_url: " << path << endl);
+        m->urlcache.erase(it);
+    }
 }
 
 
@@ -325,186 +610,308 @@ bool PlgWithSlave::doproxy()
     return m->doproxy();
 }
 
-static void catstring(string& dest, const string& s2)
-{
-    if (s2.empty()) {
-        return;
-    }
-    if (dest.empty()) {
-        dest = s2;
-    } else {
-        dest += string(" ") + s2;
-    }
-}
-
-static int resultToEntries(const string& encoded, int stidx, int cnt,
-                           vector<UpSong>& entries)
-{
-    Json::Value decoded;
-    istringstream input(encoded);
-    input >> decoded;
-    LOGDEB0("PlgWithSlave::results: got " << decoded.size() << " entries \n");
-    LOGDEB1("PlgWithSlave::results: undecoded: " << decoded.dump() << endl);
-    bool dolimit = cnt > 0;
-    
-    for (unsigned int i = stidx; i < decoded.size(); i++) {
-#define JSONTOUPS(fld, nm) {catstring(song.fld, \
-                                      decoded[i].get(#nm, "").asString());}
-        if (dolimit && --cnt < 0) {
-            break;
-        }
-        UpSong song;
-        JSONTOUPS(id, id);
-        JSONTOUPS(parentid, pid);
-        JSONTOUPS(title, tt);
-        JSONTOUPS(artUri, upnp:albumArtURI);
-        JSONTOUPS(artist, upnp:artist);
-        JSONTOUPS(upnpClass, upnp:class);
-        JSONTOUPS(date, dc:date)
-        JSONTOUPS(date, releasedate)
-        // tp is container ("ct") or item ("it")
-        string stp = decoded[i].get("tp", "").asString();
-        if (!stp.compare("ct")) {
-            song.iscontainer = true;
-            string ss = decoded[i].get("searchable", "").asString();
-            if (!ss.empty()) {
-                song.searchable = stringToBool(ss);
-            }
-        } else  if (!stp.compare("it")) {
-            song.iscontainer = false;
-            JSONTOUPS(rsrc.uri, uri);
-            JSONTOUPS(artist, dc:creator);
-            JSONTOUPS(genre, upnp:genre);
-            JSONTOUPS(album, upnp:album);
-            JSONTOUPS(tracknum, upnp:originalTrackNumber);
-            JSONTOUPS(rsrc.mime, res:mime);
-
-            string ss = decoded[i].get("duration", "").asString();
-            if (!ss.empty()) {
-                song.rsrc.duration_secs = atoi(ss.c_str());
-            }
-            ss = decoded[i].get("res:size", "").asString();
-            if (!ss.empty()) {
-                song.rsrc.size = atoll(ss.c_str());
-            }
-            ss = decoded[i].get("res:bitrate", "").asString();
-            if (!ss.empty()) {
-                song.rsrc.bitrate = atoi(ss.c_str());
-            }
-            ss = decoded[i].get("res:samplefreq", "").asString();
-            if (!ss.empty()) {
-                song.rsrc.samplefreq = atoi(ss.c_str());
-            }
-            ss = decoded[i].get("res:bitsPerSample", "").asString();
-            if (!ss.empty()) {
-                song.rsrc.bitsPerSample = atoi(ss.c_str());
-            }
-            ss = decoded[i].get("res:channels", "").asString();
-            if (!ss.empty()) {
-                song.rsrc.channels = atoi(ss.c_str());
-            }
-        } else {
-            LOGERR("PlgWithSlave::result: bad type in entry: " << stp <<
-                   "(title: " << song.title << ")\n");
-            continue;
-        }
-        LOGDEB1("PlgWitSlave::result: pushing: " << song.dump() << endl);
-        entries.push_back(song);
-    }
-    // We return the total match size, the count of actually returned
-    // entries can be obtained from the vector
-    return decoded.size();
-}
-
-
 class ContentCacheEntry {
 public:
     ContentCacheEntry()
         : m_time(time(0)) {
     }
+    // Pre-render the DIDL data for the entries, using the
+    // UpSong::PropFlags filter from the current request. Further
+    // requests with the same filter can just copy the data.
+    void render(unsigned int props);
+    // Output the requested window, possibly in sorted order (critskey
+    // is a sortCritsKey() value).
     int toResult(const string& classfilter, int stidx, int cnt,
-                 vector<UpSong>& entries) const;
+                 CDResultSink& sink, const string& critskey = string()) const;
+    // Sorted order of the entries, computed on first use and kept
+    // with the entry.
+    std::shared_ptr<const vector<int> > sortorder(const string& critskey)
+        const;
+    // Approximate memory usage
+    size_t memsize() const;
+    // Ids of the first containers (at most max) in the window.
+    void containers(int stidx, int cnt, size_t max,
+                    vector<string>& ids) const;
     time_t m_time;
     vector<UpSong> m_results;
+    // If this is >= 0, m_results only holds the window which was
+    // requested from a paging slave, and this is the total count.
+    int m_total{-1};
+    // Rendered entries, concatenated. Entry i is the
+    // [m_offsets[i], m_offsets[i+1]) slice.
+    string m_didl;
+    vector<size_t> m_offsets;
+    unsigned int m_props{0};
+    // Sort permutations, by criteria. The entry is shared and
+    // otherwise read-only once cached, hence the mutex. These are not
+    // counted in memsize().
+    mutable std::mutex m_sortmutex;
+    mutable unordered_map<string, std::shared_ptr<const vector<int> > >
+    m_sorts;
 };
 
+void ContentCacheEntry::render(unsigned int props)
+{
+    m_props = props;
+    m_didl.clear();
+    m_offsets.clear();
+    if (props == 0) {
+        return;
+    }
+    size_t sz = 0;
+    for (const auto& entry : m_results) {
+        sz += entry.didlsize();
+    }
+    m_didl.reserve(sz);
+    m_offsets.reserve(m_results.size() + 1);
+    for (const auto& entry : m_results) {
+        m_offsets.push_back(m_didl.size());
+        entry.didl(m_didl, props);
+    }
+    m_offsets.push_back(m_didl.size());
+}
+
+std::shared_ptr<const vector<int> >
+ContentCacheEntry::sortorder(const string& critskey) const
+{
+    std::unique_lock<std::mutex> lock(m_sortmutex);
+    auto it = m_sorts.find(critskey);
+    if (it != m_sorts.end()) {
+        return it->second;
+    }
+    auto perm = std::make_shared<vector<int> >();
+    sortPermutation(m_results, critskey, *perm);
+    m_sorts[critskey] = perm;
+    return perm;
+}
+
 int ContentCacheEntry::toResult(const string& classfilter, int stidx, int cnt,
-                                vector<UpSong>& entries) const
+                                CDResultSink& sink,
+                                const string& critskey) const
 {
     const vector<UpSong>& res = m_results;
     LOGDEB0("searchCacheEntryToResult: filter " << classfilter << " start " <<
-            stidx << " cnt " << cnt << " res.size " << res.size() << endl);
-    entries.reserve(cnt);
-    int total = 0;
-    for (unsigned int i = 0; i < res.size(); i++) {
-        if (!classfilter.empty() && res[i].upnpClass.find(classfilter) != 0) {
+            stidx << " cnt " << cnt << " sort " << critskey << " res.size " <<
+            res.size() << endl);
+    bool rendered = m_props != 0 && m_props == sink.didlProps() &&
+        m_offsets.size() == res.size() + 1;
+    int total = res.size();
+    if (m_total >= 0) {
+        // Window entry: the caller's offset and count were applied
+        // by the slave.
+        stidx = cnt = 0;
+        total = m_total;
+    }
+    // We can only sort complete lists. The callers don't ask the
+    // slave for a window if sorting is needed.
+    std::shared_ptr<const vector<int> > order;
+    if (!critskey.empty() && m_total < 0) {
+        order = sortorder(critskey);
+    }
+
+    if (classfilter.empty() && !order) {
+        // Contiguous slice: a single copy if we have the DIDL.
+        size_t start = stidx > 0 ? std::min(size_t(stidx), res.size()) : 0;
+        size_t end = cnt > 0 ? std::min(start + cnt, res.size()) : res.size();
+        if (rendered) {
+            sink.addDidl(m_didl.data() + m_offsets[start],
+                         m_offsets[end] - m_offsets[start], end - start);
+        } else {
+            size_t sz = 0;
+            for (size_t i = start; i < end; i++) {
+                sz += res[i].didlsize();
+            }
+            sink.reserve(sz);
+            for (size_t i = start; i < end; i++) {
+                sink.add(res[i]);
+            }
+        }
+        return total;
+    }
+
+    int count = 0;
+    for (unsigned int k = 0; k < res.size(); k++) {
+        unsigned int i = order ? (*order)[k] : k;
+        if (!classfilter.empty() &&
+            res[i].upnpClass.find(classfilter) != 0) {
             continue;
         }
-        total++;
-        if (stidx > int(i)) {
+        if (stidx > int(k)) {
             continue;
         }
-        if (cnt && int(entries.size()) >= cnt) {
+        if (cnt && count >= cnt) {
             break;
         }
         LOGDEB1("ContentCacheEntry::toResult: pushing class " <<
                 res[i].upnpClass << " tt " << res[i].title << endl);
-        entries.push_back(res[i]);
+        if (rendered) {
+            sink.addDidl(m_didl.data() + m_offsets[i],
+                         m_offsets[i+1] - m_offsets[i], 1);
+        } else {
+            sink.add(res[i]);
+        }
+        count++;
     }
-    return res.size();
+    return total;
 }
 
+void ContentCacheEntry::containers(int stidx, int cnt, size_t max,
+                                   vector<string>& ids) const
+{
+    if (m_total >= 0 || stidx < 0) {
+        stidx = 0;
+    }
+    if (m_total >= 0 || cnt <= 0) {
+        cnt = m_results.size();
+    }
+    for (size_t i = stidx; i < m_results.size() && i < size_t(stidx + cnt) &&
+             ids.size() < max; i++) {
+        if (m_results[i].iscontainer) {
+            ids.push_back(m_results[i].id);
+        }
+    }
+}
+
+// Approximate memory usage for an entry, for the cache budget.
+static size_t songmemsize(const UpSong& song)
+{
+    return sizeof(UpSong) + song.id.size() + song.parentid.size() +
+        song.name.size() + song.artist.size() + song.album.size() +
+        song.title.size() + song.tracknum.size() + song.genre.size() +
+        song.artUri.size() + song.upnpClass.size() + song.date.size() +
+        song.rsrc.uri.size() + song.rsrc.mime.size() +
+        song.resources.size() * sizeof(UpSong::Res);
+}
+
+size_t ContentCacheEntry::memsize() const
+{
+    size_t sz = sizeof(ContentCacheEntry) + m_didl.capacity() +
+        m_offsets.capacity() * sizeof(size_t);
+    for (const auto& entry : m_results) {
+        sz += songmemsize(entry);
+    }
+    return sz;
+}
+
+// Cache for browse or search results. Entries are immutable once
+// stored, and shared with the callers, so that a hit does not copy
+// anything. Entries are dropped when they are older than the
+// retention time, or in least recently used order when the memory
+// budget is exceeded. This is accessed from multiple threads.
 class ContentCache {
 public:
-    ContentCache(int retention_secs = 300);
-    ContentCacheEntry *get(const string& query);
-    void set(const string& query, ContentCacheEntry &entry);
-    void purge();
+    ContentCache(int retention_secs = 300)
+        : m_retention_secs(retention_secs) {
+    }
+    std::shared_ptr<const ContentCacheEntry> get(const string& query);
+    void set(const string& query,
+             std::shared_ptr<const ContentCacheEntry> entry);
+    // Set the memory budget in bytes.
+    void setbudget(size_t bytes);
+    int retention() const {
+        return m_retention_secs;
+    }
 private:
-    time_t m_lastpurge;
+    struct Node {
+        string key;
+        std::shared_ptr<const ContentCacheEntry> entry;
+        size_t size;
+    };
+    typedef list<Node> lru_type;
+    void purge();
+    void erase(lru_type::iterator it);
+
+    std::mutex m_mutex;
+    time_t m_lastpurge{0};
     int m_retention_secs;
-    unordered_map<string, ContentCacheEntry> m_cache;
+    size_t m_budget{10 * 1024 * 1024};
+    size_t m_bytes{0};
+    // Most recently used first
+    lru_type m_lru;
+    unordered_map<string, lru_type::iterator> m_map;
+    // Statistics
+    unsigned int m_hits{0};
+    unsigned int m_misses{0};
+    unsigned int m_evictions{0};
 };
 
-ContentCache::ContentCache(int retention_secs)
-    : m_lastpurge(time(0)), m_retention_secs(retention_secs)
+void ContentCache::erase(lru_type::iterator it)
 {
+    m_bytes -= it->size;
+    m_map.erase(it->key);
+    m_lru.erase(it);
 }
 
+// Called with the lock held
 void ContentCache::purge()
 {
     time_t now(time(0));
     if (now - m_lastpurge < 5) {
         return;
     }
-    for (auto it = m_cache.begin(); it != m_cache.end(); ) {
-        if (now - it->second.m_time > m_retention_secs) {
-            LOGDEB0("ContentCache::purge: erasing " << it->first << endl);
-            it = m_cache.erase(it);
+    for (auto it = m_lru.begin(); it != m_lru.end(); ) {
+        if (now - it->entry->m_time > m_retention_secs) {
+            LOGDEB0("ContentCache::purge: erasing " << it->key << endl);
+            auto todel = it++;
+            erase(todel);
         } else {
             it++;
         }
     }
     m_lastpurge = now;
+    LOGDEB("ContentCache: " << m_map.size() << " entries, " << m_bytes <<
+           " bytes. hits " << m_hits << " misses " << m_misses <<
+           " evictions " << m_evictions << endl);
 }
 
-ContentCacheEntry *ContentCache::get(const string& key)
+std::shared_ptr<const ContentCacheEntry> ContentCache::get(const string& key)
 {
+    std::unique_lock<std::mutex> lock(m_mutex);
     purge();
-    auto it = m_cache.find(key);
-    if (it != m_cache.end()) {
+    auto it = m_map.find(key);
+    if (it != m_map.end()) {
         LOGDEB0("ContentCache::get: found " << key << endl);
-        // we return a copy of the vector. Make our multi-access life simpler...
-        return new ContentCacheEntry(it->second);
+        m_hits++;
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return it->second->entry;
     }
     LOGDEB0("ContentCache::get: not found " << key << endl);
-    return nullptr;
+    m_misses++;
+    return std::shared_ptr<const ContentCacheEntry>();
 }
 
-void ContentCache::set(const string& key, ContentCacheEntry &entry)
+void ContentCache::set(const string& key,
+                       std::shared_ptr<const ContentCacheEntry> entry)
 {
-    LOGDEB0("ContentCache::set: " << key << endl);
-    m_cache[key] = entry;
+    size_t size = entry->memsize() + key.size();
+    LOGDEB0("ContentCache::set: " << key << " size " << size << endl);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = m_map.find(key);
+    if (it != m_map.end()) {
+        erase(it->second);
+    }
+    if (size > m_budget) {
+        LOGDEB("ContentCache::set: " << key << " too big for budget\n");
+        return;
+    }
+    while (m_bytes + size > m_budget && !m_lru.empty()) {
+        LOGDEB0("ContentCache::set: evicting " << m_lru.back().key << endl);
+        erase(--m_lru.end());
+        m_evictions++;
+    }
+    m_lru.push_front(Node{key, entry, size});
+    m_map[key] = m_lru.begin();
+    m_bytes += size;
+}
+
+void ContentCache::setbudget(size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_budget = bytes;
+    while (m_bytes > m_budget && !m_lru.empty()) {
+        erase(--m_lru.end());
+        m_evictions++;
+    }
 }
 
 // Cache for searches
@@ -512,30 +919,296 @@ static ContentCache o_scache(300);
 // Cache for browsing
 static ContentCache o_bcache(180);
 
+// Optional disk tier, how long entries are kept there, and size limit.
+static DiskCache *o_dcache;
+static int o_dcachesecs;
+static int o_dcachemb{100};
+
+// Background prefetching of the next page and of the first child
+// containers after a browse. See maybePrefetch().
+static bool o_prefetch;
+static int o_prefetchchildren{3};
+static void *prefetchWorker(void *);
+
+class PrefetchTask {
+public:
+    PlgWithSlave::Internal *m;
+    // Foreground generation when queued
+    unsigned int gen;
+    // Filter flags from the request, for rendering the cache entries
+    unsigned int props;
+    struct Item {
+        string objid;
+        int stidx;
+        int cnt;
+    };
+    vector<Item> items;
+};
+// A new task replaces the ones still queued (put() flushes), so we
+// use shared_ptr for automatic deletion.
+static WorkQueue<std::shared_ptr<PrefetchTask> > o_prefetchq("Prefetch");
+// Set in the prefetch thread, so that its requests do not count as
+// foreground ones, or trigger more prefetching.
+static thread_local bool tl_prefetching;
+
+static void startPrefetch()
+{
+    if (!o_prefetchq.start(1, prefetchWorker, nullptr)) {
+        LOGERR("PlgWithSlave: could not start prefetch thread\n");
+        o_prefetch = false;
+    }
+}
+
+// Set the cache budgets from the configuration. The total is split
+// between the browse and search caches. Also create the disk cache if
+// it is enabled.
+static void initcaches()
+{
+    static std::once_flag once;
+    std::call_once(once, [] () {
+            int mbs = 20;
+            string val;
+            if (g_config && g_config->get("plgcachemb", val)) {
+                mbs = atoi(val.c_str());
+            }
+            size_t bytes = size_t(mbs > 0 ? mbs : 0) * 1024 * 1024;
+            o_bcache.setbudget(bytes / 2);
+            o_scache.setbudget(bytes / 2);
+            if (g_config && g_config->get("plgdiskcachesecs", val)) {
+                o_dcachesecs = atoi(val.c_str());
+            }
+            if (g_config && g_config->get("plgdiskcachemb", val)) {
+                o_dcachemb = atoi(val.c_str());
+            }
+            if (g_config && g_config->get("plgprefetch", val)) {
+                o_prefetch = stringToBool(val);
+            }
+            if (g_config && g_config->get("plgprefetchchildren", val)) {
+                o_prefetchchildren = atoi(val.c_str());
+            }
+            if (o_prefetch) {
+                startPrefetch();
+            }
+            if (o_dcachesecs > 0) {
+                o_dcache = new DiskCache(
+                    path_cat(g_cachedir, "plgcache"),
+                    (long long)(o_dcachemb > 0 ? o_dcachemb : 0) * 1024 * 1024);
+                if (o_dcache->ok()) {
+                    o_dcache->purge();
+                } else {
+                    delete o_dcache;
+                    o_dcache = nullptr;
+                }
+            }
+        });
+}
+
+// Look for a result list in the disk cache. If it is found, it is
+// moved to the memory tier, where it must not outlive the disk
+// expiry time.
+static std::shared_ptr<const ContentCacheEntry>
+diskget(ContentCache& cache, const string& key, unsigned int props)
+{
+    if (nullptr == o_dcache) {
+        return std::shared_ptr<const ContentCacheEntry>();
+    }
+    auto e = std::make_shared<ContentCacheEntry>();
+    time_t expires;
+    if (!o_dcache->get(key, e->m_results, e->m_total, &expires)) {
+        return std::shared_ptr<const ContentCacheEntry>();
+    }
+    e->m_time = std::min(e->m_time, expires - cache.retention());
+    e->render(props);
+    cache.set(key, e);
+    return e;
+}
+
+// Store a new result list in the memory and disk caches.
+static void cacheset(ContentCache& cache, const string& key,
+                     std::shared_ptr<const ContentCacheEntry> e)
+{
+    cache.set(key, e);
+    if (o_dcache) {
+        o_dcache->put(key, e->m_results, e->m_total, o_dcachesecs);
+    }
+}
+
+// Cache key for a result window from a paging slave
+static string windowkey(const string& key, int stidx, int cnt)
+{
+    return key + "@" + lltodecstr(stidx) + ":" + lltodecstr(cnt);
+}
+
+// Look for the full result list, or for the requested window if the
+// slave is paging, in the memory then disk caches.
+static std::shared_ptr<const ContentCacheEntry>
+cacheget(ContentCache& cache, const string& key, int stidx, int cnt,
+         bool paging, unsigned int props)
+{
+    initcaches();
+    std::shared_ptr<const ContentCacheEntry> cep = cache.get(key);
+    if (!cep) {
+        cep = diskget(cache, key, props);
+    }
+    if (!cep && paging) {
+        string wkey = windowkey(key, stidx, cnt);
+        cep = cache.get(wkey);
+        if (!cep) {
+            cep = diskget(cache, wkey, props);
+        }
+    }
+    return cep;
+}
+
+// Process a browse or search reply: convert and possibly cache the
+// entries, and output the requested part. If the entries were cached,
+// *ep is set to the cache entry.
+//
+// The cache key is the plugin prefix for the reply's update id,
+// followed by keytail.
+//
+// If we asked for a window, the presence of the "total" value tells
+// if the slave supports paging. If it does, the reply only holds the
+// window, which is cached under its own key.
+static int replyToResult(PlgWithSlave::Internal *m, const char *what,
+                         const unordered_map<string, string>& res,
+                         bool askedwindow, ContentCache& cache,
+                         const string& keytail, const string& classfilter,
+                         int stidx, int cnt, const string& critskey,
+                         CDResultSink& sink,
+                         std::shared_ptr<const ContentCacheEntry> *ep =
+                         nullptr)
+{
+    auto ite = res.find("entries");
+    if (ite == res.end()) {
+        LOGERR("PlgWithSlave::" << what << ": no entries returned\n");
+        return -1;
+    }
+    bool nocache = false;
+    auto itc = res.find("nocache");
+    if (itc != res.end()) {
+        nocache = stringToBool(itc->second);
+    }
+    auto e = std::make_shared<ContentCacheEntry>();
+    if (jsonToEntries(ite->second, 0, 0, e->m_results) < 0) {
+        LOGERR("PlgWithSlave::" << what << ": could not decode entries\n");
+        return -1;
+    }
+    string cachekey(m->cacheprefix(res) + ":" + keytail);
+    string key(cachekey);
+    if (askedwindow) {
+        auto itt = res.find("total");
+        if (itt != res.end()) {
+            m->paging = PlgWithSlave::Internal::PagingYes;
+            e->m_total = atoi(itt->second.c_str());
+            key = windowkey(cachekey, stidx, cnt);
+        } else {
+            m->paging = PlgWithSlave::Internal::PagingNo;
+        }
+    }
+    if (!nocache) {
+        e->render(sink.didlProps());
+        cacheset(cache, key, e);
+        if (ep) {
+            *ep = e;
+        }
+    }
+    return e->toResult(classfilter, stidx, cnt, sink, critskey);
+}
+
+// Result sink for prefetching: we only want the cache to be filled.
+class PrefetchSink : public CDResultSink {
+public:
+    PrefetchSink(unsigned int props)
+        : m_props(props) {
+    }
+    virtual void add(const UpSong&) override {}
+    virtual unsigned int didlProps() const override {
+        return m_props;
+    }
+private:
+    unsigned int m_props;
+};
+
+static void *prefetchWorker(void *)
+{
+    tl_prefetching = true;
+    for (;;) {
+        std::shared_ptr<PrefetchTask> tsk;
+        if (!o_prefetchq.take(&tsk)) {
+            o_prefetchq.workerExit();
+            return (void*)1;
+        }
+        for (const auto& item : tsk->items) {
+            if (tsk->gen != tsk->m->fggen) {
+                LOGDEB1("PlgWithSlave::prefetch: cancelled\n");
+                break;
+            }
+            LOGDEB1("PlgWithSlave::prefetch: " << item.objid << " " <<
+                    item.stidx << " " << item.cnt << endl);
+            PrefetchSink sink(tsk->props);
+            tsk->m->plg->browse(item.objid, item.stidx, item.cnt, sink);
+        }
+    }
+}
+
+// After serving a browse page, queue the fetching of the next page
+// and of the first child containers, so that they are in the cache
+// when the user gets there. This runs in a single low priority
+// thread: tasks are dropped as soon as a new foreground request
+// arrives for the plugin, and a new task replaces any queued one. A
+// prefetch call which is already running can't be interrupted though.
+static void maybePrefetch(PlgWithSlave::Internal *m, const string& objid,
+                          int stidx, int cnt, int total,
+                          const ContentCacheEntry& e, unsigned int props)
+{
+    if (!o_prefetch || tl_prefetching || cnt <= 0) {
+        return;
+    }
+    auto tsk = std::make_shared<PrefetchTask>();
+    tsk->m = m;
+    tsk->gen = m->fggen;
+    tsk->props = props;
+    if (stidx + cnt < total) {
+        tsk->items.push_back(PrefetchTask::Item{objid, stidx + cnt, cnt});
+    }
+    if (o_prefetchchildren > 0) {
+        vector<string> ids;
+        e.containers(stidx, cnt, o_prefetchchildren, ids);
+        for (const auto& id : ids) {
+            tsk->items.push_back(PrefetchTask::Item{id, 0, cnt});
+        }
+    }
+    if (!tsk->items.empty()) {
+        o_prefetchq.put(tsk, true);
+    }
+}
+
 // Better return a bogus informative entry than an outright error:
-static int errorEntries(const string& pid, vector<UpSong>& entries)
+static int errorEntries(const string& pid, CDResultSink& sink)
 {
-    entries.push_back(
-        UpSong::item(pid + "$bogus", pid,
-                     "Service login or communication failure"));
+    sink.add(UpSong::item(pid + "$bogus", pid,
+                          "Service login or communication failure"));
     return 1;
 }
 
-// Note that the offset and count don't get to the plugin for
-// now. Plugins just return a (plugin-dependant) fixed number of
-// entries from offset 0, which we cache. There is no good reason for
-// this, beyond the fact that we have to cap the entry count anyway,
-// else the CP is going to read to the end which might be
-// reaaaaalllllyyyy long.
+// The offset and count are passed to the plugin as "offset" and
+// "count" arguments. Plugins which support paging return only the
+// requested window and the total count ("total"). The others ignore
+// the arguments and return a (plugin-dependant) fixed number of
+// entries from offset 0, which we cache. We stop sending the window
+// arguments to these after the first reply.
 int PlgWithSlave::browse(const string& objid, int stidx, int cnt,
-                         vector<UpSong>& entries,
+                         CDResultSink& sink,
                          const vector<string>& sortcrits,
                          BrowseFlag flg)
 {
     LOGDEB1("PlgWithSlave::browse\n");
-    entries.clear();
+    if (!tl_prefetching) {
+        m->fggen++;
+    }
     if (!m->maybeStartCmd()) {
-        return errorEntries(objid, entries);
+        return errorEntries(objid, sink);
     }
     string sbflg;
     switch (flg) {
@@ -548,61 +1221,132 @@ int PlgWithSlave::browse(const string& objid, int stidx, int cnt,
         break;
     }
 
-    string cachekey(m_name + ":" + objid);
+    string cachekey(m->cacheprefix() + ":" + objid);
+    // Sorting needs the whole list: don't ask for a window then.
+    string critskey = sortCritsKey(sortcrits);
+    bool askwindow = flg == CDPlugin::BFChildren && critskey.empty() &&
+        m->paging != Internal::PagingNo;
     if (flg == CDPlugin::BFChildren) {
         // Check cache
-        ContentCacheEntry *cep;
-        if ((cep = o_bcache.get(cachekey)) != nullptr) {
-            int total = cep->toResult("", stidx, cnt, entries);
-            delete cep;
+        std::shared_ptr<const ContentCacheEntry> cep =
+            cacheget(o_bcache, cachekey, stidx, cnt,
+                     askwindow && m->paging == Internal::PagingYes,
+                     sink.didlProps());
+        if (cep) {
+            int total = cep->toResult("", stidx, cnt, sink, critskey);
+            maybePrefetch(m, objid, stidx, cnt, total, *cep, sink.didlProps());
             return total;
         }
     }
     
+    unordered_map<string, string> args{{"objid", objid}, {"flag", sbflg}};
+    if (askwindow) {
+        args["offset"] = lltodecstr(stidx);
+        args["count"] = lltodecstr(cnt);
+    }
     unordered_map<string, string> res;
-    if (!m->cmd.callproc("browse", {{"objid", objid}, {"flag", sbflg}}, res)) {
+    if (!m->callproc(false, "browse", args, res)) {
         LOGERR("PlgWithSlave::browse: slave failure\n");
-        return errorEntries(objid, entries);
+        return errorEntries(objid, sink);
     }
 
-    auto ite = res.find("entries");
-    if (ite == res.end()) {
-        LOGERR("PlgWithSlave::browse: no entries returned\n");
-        return errorEntries(objid, entries);
-    }
-    bool nocache = false;
-    auto itc = res.find("nocache");
-    if (itc != res.end()) {
-        nocache = stringToBool(itc->second);
+    if (flg == CDPlugin::BFChildren) {
+        std::shared_ptr<const ContentCacheEntry> e;
+        int total = replyToResult(m, "browse", res, askwindow, o_bcache,
+                                  objid, "", stidx, cnt, critskey, sink,
+                                  &e);
+        if (total < 0) {
+            return errorEntries(objid, sink);
+        }
+        if (e) {
+            // Only if the results are cacheable, else prefetching
+            // would be useless.
+            maybePrefetch(m, objid, stidx, cnt, total, *e, sink.didlProps());
+        }
+        return total;
+    } else {
+        auto ite = res.find("entries");
+        if (ite == res.end()) {
+            LOGERR("PlgWithSlave::browse: no entries returned\n");
+            return errorEntries(objid, sink);
+        }
+        vector<UpSong> entries;
+        int total = jsonToEntries(ite->second, stidx, cnt, entries);
+        if (total < 0) {
+            return errorEntries(objid, sink);
+        }
+        for (const auto& entry : entries) {
+            sink.add(entry);
+        }
+        return total;
     }
+}
 
-    if (flg == CDPlugin::BFChildren) {
-        ContentCacheEntry e;
-        resultToEntries(ite->second, 0, 0, e.m_results);
-        if (!nocache) {
-            o_bcache.set(cachekey, e);
+// Compute a canonical form for a search expression, already split
+// into [property, operator, value, and/or, ...] tokens, so that
+// equivalent queries share a cache entry. Property names and
+// operators are case-folded, and so are the values (the services
+// match case-insensitively), except for upnp:class. We match classes
+// by prefix in any case, so "=" and "derivedfrom" are equivalent for
+// upnp:class. If the clauses are all and-ed, their order and
+// repetitions are irrelevant, and they are sorted.
+static void canonicalSearch(const vector<string>& vs, string& canon)
+{
+    vector<string> clauses;
+    bool allands = true;
+    for (unsigned int i = 0; i + 2 < vs.size(); i += 4) {
+        string prop = stringtolower(vs[i]);
+        string op = stringtolower(vs[i+1]);
+        string value = vs[i+2];
+        if (!prop.compare("upnp:class")) {
+            if (!op.compare("=")) {
+                op = "derivedfrom";
+            }
+        } else {
+            stringtolower(value);
+        }
+        clauses.push_back(prop + " " + op + " \"" + value + "\"");
+        if (i + 3 < vs.size() && stringtolower(vs[i+3]).compare("and")) {
+            allands = false;
         }
-        return e.toResult("", stidx, cnt, entries);
+    }
+
+    string sep(" and ");
+    if (allands) {
+        std::sort(clauses.begin(), clauses.end());
+        clauses.erase(std::unique(clauses.begin(), clauses.end()),
+                      clauses.end());
     } else {
-        return resultToEntries(ite->second, stidx, cnt, entries);
+        // Keep the connectors
+        for (unsigned int i = 3; i < vs.size(); i += 4) {
+            clauses[i/4] += " " + stringtolower(vs[i]);
+        }
+        sep = " ";
+    }
+    canon.clear();
+    for (const auto& clause : clauses) {
+        if (!canon.empty()) {
+            canon += sep;
+        }
+        canon += clause;
     }
 }
 
-// Note that the offset and count don't get to the plugin for
-// now. Plugins just return a (plugin-dependant) fixed number of
-// entries from offset 0, which we cache. There is no good reason for
-// this, beyond the fact that we have to cap the entry count anyway,
-// else the CP is going to read to the end which might be
-// reaaaaalllllyyyy long.
+// The offset and count are passed to the plugin as "offset" and
+// "count" arguments. Plugins which support paging return only the
+// requested window and the total count ("total"). The others ignore
+// the arguments and return a (plugin-dependant) fixed number of
+// entries from offset 0, which we cache. We stop sending the window
+// arguments to these after the first reply.
 int PlgWithSlave::search(const string& ctid, int stidx, int cnt,
                          const string& searchstr,
-                         vector<UpSong>& entries,
+                         CDResultSink& sink,
                          const vector<string>& sortcrits)
 {
     LOGDEB("PlgWithSlave::search: [" << searchstr << "]\n");
-    entries.clear();
+    m->fggen++;
     if (!m->maybeStartCmd()) {
-        return errorEntries(ctid, entries);
+        return errorEntries(ctid, sink);
     }
 
     // Computing a pre-cooked query. For simple-minded plugins.
@@ -629,7 +1373,7 @@ int PlgWithSlave::search(const string& ctid, int stidx, int cnt,
     if ((vs.size() + 1) % 4 != 0) {
         LOGERR("PlgWithSlave::search: bad search string: [" << searchstr <<
                "]\n");
-        return errorEntries(ctid, entries);
+        return errorEntries(ctid, sink);
     }
     string slavefield;
     string value;
@@ -671,41 +1415,48 @@ int PlgWithSlave::search(const string& ctid, int stidx, int cnt,
     }
 
     // In cache ?
-    ContentCacheEntry *cep;
-    string cachekey(m_name + ":" + ctid + ":" + searchstr);
-    if ((cep = o_scache.get(cachekey)) != nullptr) {
-        int total = cep->toResult(classfilter, stidx, cnt, entries);
-        delete cep;
-        return total;
+    string canon;
+    canonicalSearch(vs, canon);
+    // The slave arguments are extracted from the clauses in their
+    // original order, which the canonical form loses: they are part
+    // of the key.
+    string lvalue(value);
+    stringtolower(lvalue);
+    string keytail(ctid + ":" + objkind + ":" + slavefield + ":" + lvalue +
+                   ":" + canon);
+    string cachekey(m->cacheprefix() + ":" + keytail);
+    string critskey = sortCritsKey(sortcrits);
+    // Sorting and class filtering need the whole list: don't ask for
+    // a window then.
+    bool askwindow = critskey.empty() && classfilter.empty() &&
+        m->paging != Internal::PagingNo;
+    std::shared_ptr<const ContentCacheEntry> cep =
+        cacheget(o_scache, cachekey, stidx, cnt,
+                 askwindow && m->paging == Internal::PagingYes,
+                 sink.didlProps());
+    if (cep) {
+        return cep->toResult(classfilter, stidx, cnt, sink, critskey);
     }
 
     // Run query
+    unordered_map<string, string> args{
+        {"objid", ctid},
+        {"objkind", objkind},
+        {"origsearch", searchstr},
+        {"field", slavefield},
+        {"value", value}};
+    if (askwindow) {
+        args["offset"] = lltodecstr(stidx);
+        args["count"] = lltodecstr(cnt);
+    }
     unordered_map<string, string> res;
-    if (!m->cmd.callproc("search", {
-                {"objid", ctid},
-                {"objkind", objkind},
-                {"origsearch", searchstr},
-                {"field", slavefield},
-                {"value", value} },  res)) {
+    if (!m->callproc(false, "search", args, res)) {
         LOGERR("PlgWithSlave::search: slave failure\n");
-        return errorEntries(ctid, entries);
+        return errorEntries(ctid, sink);
     }
 
-    auto ite = res.find("entries");
-    if (ite == res.end()) {
-        LOGERR("PlgWithSlave::search: no entries returned\n");
-        return errorEntries(ctid, entries);
-    }
-    bool nocache = false;
-    auto itc = res.find("nocache");
-    if (itc != res.end()) {
-        nocache = stringToBool(itc->second);
-    }
-    // Convert the whole set and store in cache
-    ContentCacheEntry e;
-    resultToEntries(ite->second, 0, 0, e.m_results);
-    if (!nocache) {
-        o_scache.set(cachekey, e);
-    }
-    return e.toResult(classfilter, stidx, cnt, entries);
+    int total = replyToResult(m, "search", res, askwindow, o_scache,
+                              keytail, classfilter, stidx, cnt, critskey,
+                              sink);
+    return total < 0 ? errorEntries(ctid, sink) : total;
 }
@@ -39,24 +39,35 @@ public:
     // Proxy the streams if return is true, else redirect
     virtual bool doproxy();
     
+    using CDPlugin::browse;
+    using CDPlugin::search;
+
     // Returns totalmatches
     virtual int browse(
 	const std::string& objid, int stidx, int cnt,
-	std::vector<UpSong>& entries,
+	CDResultSink& sink,
 	const std::vector<std::string>& sortcrits = std::vector<std::string>(),
 	BrowseFlag flg = BFChildren);
 
     virtual int search(
 	const std::string& ctid, int stidx, int cnt,
 	const std::string& searchstr,
-	std::vector<UpSong>& entries,
+	CDResultSink& sink,
 	const std::vector<std::string>& sortcrits = std::vector<std::string>());
 
     // This is for internal use only, but moving it to Internal would
     // make things quite more complicated for a number of reasons.
     virtual std::string get_media_url(const std::string& path);
+    // Forget the cached translation for path, e.g. after an HTTP
+    // error status from the service.
+    virtual void invalidate_media_url(const std::string& path);
+    // Translate the URL path for a local file which we serve
+    // directly (uprcl). Returns false if this is not the case.
+    virtual bool get_local_path(const std::string& urlpath,
+                                std::string& fpath);
 
-    // used for plugins which should start initialization asap
+    // used for plugins which should start initialization asap, and
+    // to restart dead slave processes.
     bool startInit();
 
     // Used by ohcredentials to start a plugin instance
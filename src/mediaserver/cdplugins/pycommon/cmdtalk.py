@@ -28,6 +28,11 @@ import tempfile
 import shutil
 import getopt
 import traceback
+import threading
+try:
+    import queue
+except ImportError:
+    import Queue as queue
 
 PY3 = sys.version > '3'
 
@@ -49,9 +54,15 @@ else:
 # CmdTalk implements the
 # communication protocol with the master process. It calls an external
 # method to use the args and produce return data.
+#
+# If maxthreads is more than 1, we accept protocol version 2 if the
+# master asks for it: requests then carry an id, are processed by a
+# pool of threads, and the answers are sent in completion order. The
+# processor must be thread-safe in this case.
 class CmdTalk:
 
-    def __init__(self, outfile=sys.stdout, infile=sys.stdin, exitfunc=None):
+    def __init__(self, outfile=sys.stdout, infile=sys.stdin, exitfunc=None,
+                 maxthreads=1):
         try:
             self.myname = os.path.basename(sys.argv[0])
         except:
@@ -61,6 +72,9 @@ class CmdTalk:
         self.infile = infile
         self.exitfunc = exitfunc
         self.fields = {}
+        self.maxthreads = maxthreads
+        self.workqueue = None
+        self.outlock = threading.Lock()
         
         if sys.platform == "win32":
             import msvcrt
@@ -153,13 +167,14 @@ class CmdTalk:
         
     # Send answer: document, ipath, possible eof.
     def answer(self, outfields):
-        for nm,value in outfields.items():
-            #self.log("Senditem: [%s] -> [%s]" % (nm, value))
-            self.senditem(nm, value)
-            
-        # End of message
-        print(file=self.outfile)
-        self.outfile.flush()
+        with self.outlock:
+            for nm,value in outfields.items():
+                #self.log("Senditem: [%s] -> [%s]" % (nm, value))
+                self.senditem(nm, value)
+
+            # End of message
+            print(file=self.outfile)
+            self.outfile.flush()
         #self.log("done writing data")
 
     # Call processor with input params, send result
@@ -179,8 +194,29 @@ class CmdTalk:
         else:
             outfields = processor.process(params)
 
+        if "cmdtalk:rqid" in params:
+            outfields["cmdtalk:rqid"] = params["cmdtalk:rqid"]
         self.answer(outfields)
 
+    # Protocol version request from the master. Start the worker
+    # threads if we are switching to version 2.
+    def setversion(self, processor, params):
+        version = "1"
+        if self.maxthreads > 1 and params["cmdtalk:version"] == "2":
+            version = "2"
+            if not self.workqueue:
+                self.workqueue = queue.Queue()
+                for i in range(self.maxthreads):
+                    t = threading.Thread(target=self.worker, args=(processor,))
+                    t.daemon = True
+                    t.start()
+        self.answer({"cmdtalk:version" : version})
+
+    def worker(self, processor):
+        while 1:
+            params = self.workqueue.get()
+            self.processmessage(processor, params)
+
     # Loop on messages from our master
     def mainloop(self, processor):
         while 1:
@@ -188,16 +224,21 @@ class CmdTalk:
 
             params = dict()
 
-            # Read at most 10 parameters (normally 1 or 2), stop at empty line
+            # Read at most 20 parameters (normally a few), stop at empty line
             # End of message is signalled by empty paramname
-            for i in range(10):
+            for i in range(20):
                 paramname, paramdata = self.readparam()
                 if paramname == "":
                     break
                 params[paramname] = paramdata
 
             # Got message, act on it
-            self.processmessage(processor, params)
+            if "cmdtalk:version" in params:
+                self.setversion(processor, params)
+            elif self.workqueue and "cmdtalk:rqid" in params:
+                self.workqueue.put(params)
+            else:
+                self.processmessage(processor, params)
 
 
 # Common main routine for testing: either run the normal protocol
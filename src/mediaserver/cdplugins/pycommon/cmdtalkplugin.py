@@ -16,6 +16,7 @@
 
 from __future__ import print_function
 
+import os
 import sys
 import cmdtalk
 
@@ -35,11 +36,19 @@ class Dispatch:
         func = self.map[nm]
         return func(params)
     
+# The number of worker threads is set by the master through the
+# environment. With more than one, the dispatched methods are called
+# concurrently (see cmdtalk.py).
 class Processor:
     def __init__(self, dispatcher, outfile=sys.stdout, infile=sys.stdin,
-                 exitfunc=None):
+                 exitfunc=None, maxthreads=None):
+        if maxthreads is None:
+            try:
+                maxthreads = int(os.environ["UPMPD_SLAVETHREADS"])
+            except:
+                maxthreads = 1
         self.em = cmdtalk.CmdTalk(outfile=outfile, infile=infile,
-                                  exitfunc=exitfunc)
+                                  exitfunc=exitfunc, maxthreads=maxthreads)
         self.dispatcher = dispatcher
         
     def log(self, s, doexit = 0, exitvalue = 1):
@@ -27,6 +27,7 @@ our parent expects or sends on the pipe.
 """
 from __future__ import print_function, unicode_literals
 
+import json
 import posixpath
 import re
 import sys
@@ -157,9 +158,12 @@ def trackid_from_urlpath(pathprefix, a):
     return trackid
 
 
-def direntry(id, pid, title, arturi=None, artist=None, upnpclass=None):
+def direntry(id, pid, title, arturi=None, artist=None, upnpclass=None,
+             childcount=None):
     """ Create container entry in format expected by parent """
     ret = {'id':id, 'pid':pid, 'tt':title, 'tp':'ct', 'searchable':'1'}
+    if childcount is not None:
+        ret['childcount'] = str(childcount)
     if arturi:
         ret['upnp:albumArtURI'] = arturi
     if artist:
@@ -182,6 +186,28 @@ def getserviceuserpass(upconfig, servicename):
         password = altconf.get(servicename + 'pass')
     return username, password
 
+# Build the reply to a browse or search call. If the parent sent
+# 'offset' and 'count' arguments, only the requested window is
+# returned, along with the total entry count, which tells the parent
+# that we support paging. A count of 0 means "up to the end".
+# updateid identifies the state of the plugin data, and should change
+# when it is modified (e.g. index update). upmpdcli signals the
+# changes to the Control Points.
+def pagedresult(a, entries, nocache, updateid=None):
+    ret = {"nocache" : nocache}
+    if updateid:
+        ret["updateid"] = updateid
+    if 'offset' in a and 'count' in a:
+        offset = max(int(a['offset']), 0)
+        count = int(a['count'])
+        ret["total"] = str(len(entries))
+        if count > 0:
+            entries = entries[offset:offset+count]
+        else:
+            entries = entries[offset:]
+    ret["entries"] = json.dumps(entries)
+    return ret
+
 def uplog(s):
     if not type(s) == type(b''):
         s = ("%s: %s" % (_idprefix, s)).encode('utf-8')
@@ -0,0 +1,144 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "sortentries.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "smallut.h"
+
+using namespace std;
+
+enum SortField {SF_TITLE, SF_ARTIST, SF_ALBUM, SF_TRACKNUM, SF_DATE,
+                SF_GENRE, SF_CLASS};
+
+static const unordered_map<string, int> sortfields {
+    {"dc:title", SF_TITLE},
+    {"upnp:artist", SF_ARTIST},
+    {"dc:creator", SF_ARTIST},
+    {"upnp:album", SF_ALBUM},
+    {"upnp:originalTrackNumber", SF_TRACKNUM},
+    {"dc:date", SF_DATE},
+    {"upnp:genre", SF_GENRE},
+    {"upnp:class", SF_CLASS},
+};
+
+const string& sortCapabilities()
+{
+    static const string caps("dc:title,upnp:artist,dc:creator,upnp:album,"
+                             "upnp:originalTrackNumber,dc:date,upnp:genre,"
+                             "upnp:class");
+    return caps;
+}
+
+string sortCritsKey(const vector<string>& sortcrits)
+{
+    string key;
+    for (const auto& crits : sortcrits) {
+        vector<string> vcrits;
+        stringToTokens(crits, vcrits, ",");
+        for (auto crit : vcrits) {
+            trimstring(crit);
+            char dir = '+';
+            if (!crit.empty() && (crit[0] == '+' || crit[0] == '-')) {
+                dir = crit[0];
+                crit.erase(0, 1);
+            }
+            if (sortfields.find(crit) == sortfields.end()) {
+                continue;
+            }
+            if (!key.empty()) {
+                key += ',';
+            }
+            key += dir;
+            key += crit;
+        }
+    }
+    return key;
+}
+
+// Sort values for one criterion. Strings are compared
+// case-insensitively, track numbers numerically.
+class SortColumn {
+public:
+    bool descending{false};
+    bool numeric{false};
+    vector<string> svals;
+    vector<int> ivals;
+    int compare(int i, int j) const {
+        int ret;
+        if (numeric) {
+            ret = ivals[i] < ivals[j] ? -1 : (ivals[i] > ivals[j] ? 1 : 0);
+        } else {
+            ret = svals[i].compare(svals[j]);
+        }
+        return descending ? -ret : ret;
+    }
+};
+
+static const string& songfield(const UpSong& song, int field)
+{
+    switch (field) {
+    case SF_TITLE: return song.title;
+    case SF_ARTIST: return song.artist;
+    case SF_ALBUM: return song.album;
+    case SF_TRACKNUM: return song.tracknum;
+    case SF_DATE: return song.date;
+    case SF_GENRE: return song.genre;
+    case SF_CLASS: default: return song.upnpClass;
+    }
+}
+
+void sortPermutation(const vector<UpSong>& entries, const string& critskey,
+                     vector<int>& perm)
+{
+    perm.resize(entries.size());
+    for (size_t i = 0; i < perm.size(); i++) {
+        perm[i] = i;
+    }
+
+    // Extract the keys once, so that the comparisons are cheap.
+    vector<string> crits;
+    stringToTokens(critskey, crits, ",");
+    vector<SortColumn> columns(crits.size());
+    for (size_t c = 0; c < crits.size(); c++) {
+        SortColumn& col = columns[c];
+        col.descending = crits[c][0] == '-';
+        int field = sortfields.find(crits[c].substr(1))->second;
+        col.numeric = field == SF_TRACKNUM;
+        for (const auto& entry : entries) {
+            if (col.numeric) {
+                col.ivals.push_back(atoi(entry.tracknum.c_str()));
+            } else {
+                col.svals.push_back(stringtolower(songfield(entry, field)));
+            }
+        }
+    }
+
+    std::stable_sort(perm.begin(), perm.end(), [&columns](int i, int j) {
+            for (const auto& col : columns) {
+                int ret = col.compare(i, j);
+                if (ret) {
+                    return ret < 0;
+                }
+            }
+            return false;
+        });
+}
@@ -0,0 +1,48 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SORTENTRIES_H_INCLUDED_
+#define _SORTENTRIES_H_INCLUDED_
+
+#include <string>
+#include <vector>
+
+#include "upmpdutils.hxx"
+
+//
+// Server-side sorting of browse/search results, according to the
+// ContentDirectory SortCriteria argument.
+//
+
+/// Comma-separated list of the properties we can sort on, for
+/// GetSortCapabilities.
+extern const std::string& sortCapabilities();
+
+/// Compute a canonical form for the supported part of a SortCriteria
+/// (as split on white space by the caller, e.g. "+upnp:artist,-dc:date").
+/// Unsupported properties are ignored. An empty result means that no
+/// sorting is needed.
+extern std::string sortCritsKey(const std::vector<std::string>& sortcrits);
+
+/// Compute the sorted order of the entries. The sort is stable.
+/// @param critskey value returned by sortCritsKey().
+/// @param[out] perm indices of the entries in sorted order.
+extern void sortPermutation(const std::vector<UpSong>& entries,
+                            const std::string& critskey,
+                            std::vector<int>& perm);
+
+#endif /* _SORTENTRIES_H_INCLUDED_ */
@@ -855,6 +855,21 @@ public:
             return 0;
         }
 
+        // Consumer too slow: libspotify will deliver the frames
+        // again later. Once paused, we wait for the queue to drain
+        // below the low watermark before accepting data again.
+        if (p->outqueue) {
+            if (_paused) {
+                if (!p->outqueue->drained()) {
+                    return 0;
+                }
+                _paused = false;
+            } else if (p->outqueue->full()) {
+                _paused = true;
+                return 0;
+            }
+        }
+
         int bytes = num_frames * chans * 2;
         if (_totalsent + bytes > _contentlen) {
             bytes = _contentlen - _totalsent;
@@ -925,6 +940,9 @@ public:
     int _durationms{0};
     uint64_t _contentlen{0};
     uint64_t _totalsent{0};
+    // Backpressure: set when the output queue was full (framesink()
+    // thread only).
+    bool _paused{false};
 
     condition_variable _cv;
     condition_variable _dryruncv;
@@ -980,6 +998,7 @@ bool SpotiFetch::start(BufXChange<ABuffer*> *queue, uint64_t offset)
     m->_initseekmsecs = v;
     
     m->_dryrun = false;
+    m->_paused = false;
     // Reset samplerate so that the external waitForHeaders will only
     // return after we get the first frame and the actual contentlen
     // is computed (and samplerate set again).
@@ -24,16 +24,33 @@
 #endif
 #include "smallut.h"
 #include "chrono.h"
+#include "pathut.h"
 
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <microhttpd.h>
 
+#include <algorithm>
+#include <set>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <unordered_map>
 
 using namespace std;
 
+// Data block size for the proxied streams. This matches the size of
+// the NetFetch queue buffers.
+static const size_t mhdblocksize(64 * 1024);
+
+// What a stream can always buffer, even if the total budget is used up.
+static const size_t minstreambytes(512 * 1024);
+
+// Interval for logging the stream statistics while streaming.
+static const int statslogsecs(60);
+
 class ContentReader {
 public:
     ContentReader(std::unique_ptr<NetFetch> ftchr, int cfd)
@@ -52,6 +69,9 @@ public:
     std::unique_ptr<NetFetch> fetcher;
     BufXChange<ABuffer*> queue{"crqueue"};
     bool normalEOS{false};
+    // Updated by the microhttpd thread, read by streamStats()
+    std::atomic<uint64_t> sent{0};
+    StreamProxy::Internal *proxy{nullptr};
     // Used for experimentations in killing the connection
     int connfd{-1};
     int killafterms{-1};
@@ -69,7 +89,13 @@ ssize_t ContentReader::contentRead(uint64_t pos, char *obuf, size_t max)
     size_t totcnt = 0;
     ABuffer *abuf;
     while (totcnt < max) {
-        if (!queue.take(&abuf)) {
+        // Only wait for data if we have none to return yet. Else
+        // send what we have, which matters for slow (live) streams.
+        if (totcnt > 0) {
+            if (!queue.take_nowait(&abuf)) {
+                break;
+            }
+        } else if (!queue.take(&abuf)) {
             NetFetch::FetchStatus code;
             int httpcode;
             fetcher->fetchDone(&code, &httpcode);
@@ -118,19 +144,10 @@ ssize_t ContentReader::contentRead(uint64_t pos, char *obuf, size_t max)
         }
     }
     LOGDEB1("ContentReader::contentRead: return " << totcnt << endl);
+    sent += totcnt;
     return totcnt;
 }
 
-static ssize_t content_reader_cb(void *cls, uint64_t pos, char *buf, size_t max)
-{
-    ContentReader *reader = static_cast<ContentReader*>(cls);
-    if (reader) {
-        return reader->contentRead(pos, buf, max);
-    } else {
-        return -1;
-    }
-}
-
 
 class StreamProxy::Internal {
 public:
@@ -148,13 +165,40 @@ public:
         struct MHD_Connection *conn,
         void **con_cls, enum MHD_RequestTerminationCode toe);
 
+    bool fileAllowed(const string& rpath);
+    vector<StreamStats> streamStats();
+    void maybeLogStats();
+    int answerFile(struct MHD_Connection *mhdconn, const string& path);
+
     int listenport{-1};
     UrlTransFunc urltrans;
     struct MHD_Daemon *mhd{nullptr};
     int killafterms{-1};
+    // Directories from which we may serve local files (canonic paths)
+    std::mutex rootsmutex;
+    vector<string> fileroots;
+    // Buffered data budgets, and active proxied streams.
+    size_t streambudget{0};
+    BufBudget totalbudget;
+    std::mutex readersmutex;
+    std::set<ContentReader*> readers;
+    Chrono statschron;
 };
 
 
+static ssize_t content_reader_cb(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    ContentReader *reader = static_cast<ContentReader*>(cls);
+    if (reader) {
+        ssize_t ret = reader->contentRead(pos, buf, max);
+        reader->proxy->maybeLogStats();
+        return ret;
+    } else {
+        return -1;
+    }
+}
+
+
 StreamProxy::StreamProxy(int listenport,UrlTransFunc urltrans)
     : m(new Internal(listenport, urltrans))
 {
@@ -165,6 +209,73 @@ void StreamProxy::setKillAfterMs(int ms)
     m->killafterms = ms;
 }
 
+void StreamProxy::addFileRoot(const string& dir)
+{
+    string canon = path_canon(dir);
+    if (canon.empty()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m->rootsmutex);
+    if (find(m->fileroots.begin(), m->fileroots.end(), canon) ==
+        m->fileroots.end()) {
+        LOGDEB("StreamProxy::addFileRoot: " << canon << endl);
+        m->fileroots.push_back(canon);
+    }
+}
+
+void StreamProxy::setBufferBudget(size_t streambytes, size_t totalbytes)
+{
+    LOGDEB("StreamProxy::setBufferBudget: stream " << streambytes <<
+           " total " << totalbytes << endl);
+    m->streambudget = streambytes;
+    m->totalbudget.setmax(totalbytes);
+}
+
+vector<StreamProxy::StreamStats> StreamProxy::streamStats()
+{
+    return m->streamStats();
+}
+
+vector<StreamProxy::StreamStats> StreamProxy::Internal::streamStats()
+{
+    vector<StreamStats> ret;
+    std::unique_lock<std::mutex> lock(readersmutex);
+    for (auto reader : readers) {
+        auto qst = reader->queue.stats();
+        StreamStats st;
+        st.url = reader->fetcher->url();
+        st.sentbytes = reader->sent;
+        st.bufbytes = qst.bytes;
+        st.peakbytes = qst.peakbytes;
+        st.hiwater = qst.hibytes;
+        st.lowater = qst.lobytes;
+        st.pauses = qst.fullcnt;
+        ret.push_back(st);
+    }
+    return ret;
+}
+
+// Called from the data callbacks: log the statistics for all the
+// active streams every statslogsecs.
+void StreamProxy::Internal::maybeLogStats()
+{
+    {
+        std::unique_lock<std::mutex> lock(readersmutex);
+        if (statschron.secs() < statslogsecs) {
+            return;
+        }
+        statschron.restart();
+    }
+    for (const auto& st : streamStats()) {
+        LOGINF("StreamProxy: " << st.url << " sent " << st.sentbytes <<
+               " buffered " << st.bufbytes << " peak " << st.peakbytes <<
+               " watermarks " << st.hiwater << "/" << st.lowater <<
+               " pauses " << st.pauses << endl);
+    }
+    LOGINF("StreamProxy: total buffered " << totalbudget.used() << " peak " <<
+           totalbudget.peak() << " budget " << totalbudget.max() << endl);
+}
+
 StreamProxy::~StreamProxy()
 {
 }
@@ -231,7 +342,7 @@ static int mapvalues_cb(void *cls, enum MHD_ValueKind kind,
     return MHD_YES;
 }
 
-// Parse range header. 
+// Parse range header. A missing first or last position is returned as -1.
 static bool parseRanges(
     const string& ranges, vector<pair<int64_t, int64_t>>& oranges)
 {
@@ -249,7 +360,8 @@ static bool parseRanges(
         }
         string::size_type comma = ranges.find(',', pos);
         string firstPart = ranges.substr(pos, dash-pos);
-        int64_t start = firstPart.empty() ? 0 : atoll(firstPart.c_str());
+        // -1 for a suffix range (bytes=-500: the last 500 bytes)
+        int64_t start = firstPart.empty() ? -1 : atoll(firstPart.c_str());
         string secondPart = ranges.substr(dash+1, comma != string::npos ? 
                                           comma-dash-1 : string::npos);
         int64_t fin = secondPart.empty() ? -1 : atoll(secondPart.c_str());
@@ -269,7 +381,8 @@ static bool processRange(struct MHD_Connection *mhdconn, uint64_t& offset)
         MHD_lookup_connection_value(mhdconn, MHD_HEADER_KIND, "range");
     vector<pair<int64_t, int64_t> > ranges;
     if (rangeh && parseRanges(rangeh, ranges) && ranges.size()) {
-        if (ranges[0].second != -1 || ranges.size() > 1) {
+        if (ranges[0].first < 0 || ranges[0].second != -1 ||
+            ranges.size() > 1) {
             LOGERR("AProxy::mhdAnswerConn: unsupported range: " <<
                    rangeh << "\n");
             struct MHD_Response *response = 
@@ -286,6 +399,177 @@ static bool processRange(struct MHD_Connection *mhdconn, uint64_t& offset)
     return true;
 }
 
+const std::string StreamProxy::resolveOnlyHeader("X-Upmpdcli-Resolve-Only");
+
+static bool realPath(const string& path, string& rpath)
+{
+    char *cp = realpath(path.c_str(), nullptr);
+    if (nullptr == cp) {
+        return false;
+    }
+    rpath = cp;
+    free(cp);
+    return true;
+}
+
+// Local files are only served from inside the configured
+// directories. Both the file and the directories paths are resolved
+// (".." elements, symbolic links), so that a link inside a media
+// directory can't be used to get out. The directories are resolved
+// each time because they may be mounted after we start.
+// rpath is the resolved file path, which is what should be opened.
+bool StreamProxy::Internal::fileAllowed(const string& rpath)
+{
+    vector<string> roots;
+    {
+        std::unique_lock<std::mutex> lock(rootsmutex);
+        roots = fileroots;
+    }
+    for (const auto& dir : roots) {
+        string root;
+        if (!realPath(dir, root)) {
+            continue;
+        }
+        if (root == "/" || rpath == root ||
+            (rpath.size() > root.size() && rpath[root.size()] == '/' &&
+             rpath.compare(0, root.size(), root) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const vector<pair<string, string> > suffmimes {
+    {"flac", "audio/flac"}, {"mp3", "audio/mpeg"}, {"wav", "audio/wav"},
+    {"ogg", "audio/ogg"}, {"oga", "audio/ogg"}, {"opus", "audio/ogg"},
+    {"m4a", "audio/mp4"}, {"mp4", "audio/mp4"}, {"aac", "audio/aac"},
+    {"aif", "audio/aiff"}, {"aiff", "audio/aiff"}, {"dsf", "audio/x-dsf"},
+    {"dff", "audio/x-dff"}, {"wv", "audio/x-wavpack"}, {"ape", "audio/ape"},
+    {"mpc", "audio/x-musepack"}, {"wma", "audio/x-ms-wma"},
+    {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"png", "image/png"},
+};
+
+static string mimeForPath(const string& path)
+{
+    string suff = stringtolower(path_suffix(path));
+    for (const auto& ent : suffmimes) {
+        if (suff == ent.first) {
+            return ent.second;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int answerStatus(struct MHD_Connection *mhdconn, unsigned int code,
+                        const string& crange = string())
+{
+    struct MHD_Response *response =
+        MHD_create_response_from_buffer(0, 0, MHD_RESPMEM_PERSISTENT);
+    if (nullptr == response) {
+        return MHD_NO;
+    }
+    if (!crange.empty()) {
+        MHD_add_response_header(response, "Content-Range", crange.c_str());
+    }
+    int ret = MHD_queue_response(mhdconn, code, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Serve a local file. The data is sent by microhttpd directly from
+// the file descriptor, using sendfile() when possible, so that it
+// never gets copied to user space. We support single byte ranges,
+// including suffix ones. Multiple ranges are ignored (the whole file
+// is sent, which is allowed by the RFC).
+int StreamProxy::Internal::answerFile(
+    struct MHD_Connection *mhdconn, const string& path)
+{
+    string rpath;
+    if (!realPath(path, rpath)) {
+        LOGERR("StreamProxy::answerFile: can't resolve " << path << " errno " <<
+               errno << endl);
+        return answerStatus(mhdconn, MHD_HTTP_NOT_FOUND);
+    }
+    if (!fileAllowed(rpath)) {
+        LOGERR("StreamProxy::answerFile: not allowed: " << path << " -> " <<
+               rpath << endl);
+        return answerStatus(mhdconn, MHD_HTTP_FORBIDDEN);
+    }
+    int fd = open(rpath.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        LOGERR("StreamProxy::answerFile: can't open " << path << " errno " <<
+               errno << endl);
+        return answerStatus(mhdconn, MHD_HTTP_NOT_FOUND);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        LOGERR("StreamProxy::answerFile: not a regular file: " << path << endl);
+        close(fd);
+        return answerStatus(mhdconn, MHD_HTTP_NOT_FOUND);
+    }
+    int64_t size = st.st_size;
+    int64_t first = 0;
+    int64_t last = size - 1;
+    unsigned int code = MHD_HTTP_OK;
+
+    const char* rangeh =
+        MHD_lookup_connection_value(mhdconn, MHD_HEADER_KIND, "range");
+    vector<pair<int64_t, int64_t> > ranges;
+    if (rangeh && parseRanges(rangeh, ranges) && ranges.size() == 1) {
+        first = ranges[0].first;
+        last = ranges[0].second;
+        if (first < 0) {
+            // Suffix range
+            first = last > 0 ? std::max(size - last, int64_t(0)) : size;
+            last = size - 1;
+        } else if (last < 0 || last >= size) {
+            last = size - 1;
+        }
+        if (first >= size || last < first) {
+            LOGDEB("StreamProxy::answerFile: unsatisfiable range " << rangeh <<
+                   " size " << size << endl);
+            close(fd);
+            return answerStatus(
+                mhdconn, MHD_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE,
+                string("bytes */") + lltodecstr(size));
+        }
+        code = MHD_HTTP_PARTIAL_CONTENT;
+    }
+    LOGDEB("StreamProxy::answerFile: " << path << " bytes " << first << "-" <<
+           last << "/" << size << endl);
+
+    // The response owns the fd from now on.
+#if MHD_VERSION >= 0x00094400
+    struct MHD_Response *response = MHD_create_response_from_fd_at_offset64(
+        uint64_t(last - first + 1), fd, uint64_t(first));
+#else
+    struct MHD_Response *response = MHD_create_response_from_fd_at_offset(
+        size_t(last - first + 1), fd, off_t(first));
+#endif
+    if (nullptr == response) {
+        LOGERR("StreamProxy::answerFile: could not create response\n");
+        close(fd);
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Accept-Ranges", "bytes");
+    MHD_add_response_header(response, "Content-Type",
+                            mimeForPath(path).c_str());
+    if (code == MHD_HTTP_PARTIAL_CONTENT) {
+        string crange = string("bytes ") + lltodecstr(first) + "-" +
+            lltodecstr(last) + "/" + lltodecstr(size);
+        MHD_add_response_header(response, "Content-Range", crange.c_str());
+    }
+    char lm[100];
+    struct tm tmb;
+    if (gmtime_r(&st.st_mtime, &tmb) &&
+        strftime(lm, sizeof(lm), "%a, %d %b %Y %H:%M:%S GMT", &tmb)) {
+        MHD_add_response_header(response, "Last-Modified", lm);
+    }
+    int ret = MHD_queue_response(mhdconn, code, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
 int StreamProxy::Internal::answerConn(
     struct MHD_Connection *mhdconn, const char *_url,
     const char *method, const char *version, 
@@ -306,9 +590,6 @@ int StreamProxy::Internal::answerConn(
             LOGERR("StreamProxy::answerConn: method is not GET or HEAD\n");
             return MHD_NO;
         }
-        if (!processRange(mhdconn, offset)) {
-            return MHD_NO;
-        }
 
         // Compute destination url
         unordered_map<string,string>querydata;
@@ -323,7 +604,23 @@ int StreamProxy::Internal::answerConn(
         
         if (ret == Error) {
             return MHD_NO;
-        } else if (ret == Redirect) {
+        }
+        // Translation-only request (e.g. next track hint from the
+        // renderer): the translation is done and cached, we're done.
+        if (MHD_lookup_connection_value(mhdconn, MHD_HEADER_KIND,
+                                        resolveOnlyHeader.c_str())) {
+            LOGDEB("StreamProxy::answerConn: resolved hinted " << _url <<
+                   endl);
+            struct MHD_Response *response =
+                MHD_create_response_from_buffer(0, 0, MHD_RESPMEM_PERSISTENT);
+            if (nullptr == response ) {
+                return MHD_NO;
+            }
+            int ret = MHD_queue_response(mhdconn, 204, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+        if (ret == Redirect) {
             struct MHD_Response *response =
                 MHD_create_response_from_buffer(0, 0, MHD_RESPMEM_PERSISTENT);
             if (nullptr == response ) {
@@ -335,6 +632,13 @@ int StreamProxy::Internal::answerConn(
             MHD_destroy_response(response);
             return ret;
         }
+        if (ret == LocalFile) {
+            return answerFile(mhdconn, url);
+        }
+
+        if (!processRange(mhdconn, offset)) {
+            return MHD_NO;
+        }
 
         // The connection fd thing is strictly for debug/diag: faking
         // a connection loss so that the client side can exercise the
@@ -355,6 +659,15 @@ int StreamProxy::Internal::answerConn(
             reader->killafterms = killafterms;
             killafterms = -1;
         }
+        reader->proxy = this;
+        reader->queue.setBudget(
+            [](ABuffer* const& buf) {
+                return size_t(buf->bytes - buf->curoffs);
+            }, streambudget, &totalbudget, minstreambytes);
+        {
+            std::unique_lock<std::mutex> lock(readersmutex);
+            readers.insert(reader);
+        }
         reader->fetcher->start(&reader->queue, offset);
         *con_cls = reader;
 
@@ -388,11 +701,12 @@ int StreamProxy::Internal::answerConn(
         LOGDEB1("mhdAnswerConn: header content-length: " << cl << endl);
         size  = (uint64_t)atoll(cl.c_str());
     }
-    // Build a data response.
-    // the block size seems to be flatly ignored by libmicrohttpd
-    // Any random value would probably work the same
+    // Build a data response. The block size is the size of the
+    // microhttpd buffer which contentRead() fills, and so the max
+    // size of the socket writes. 4096 meant a callback and a write
+    // call for each 4 KB.
     struct MHD_Response *response = 
-        MHD_create_response_from_callback(size, 4096,
+        MHD_create_response_from_callback(size, mhdblocksize,
                                           content_reader_cb, reader, nullptr);
     if (response == NULL) {
         LOGERR("mhdAnswerConn: answer: could not create response" << endl);
@@ -457,6 +771,15 @@ void StreamProxy::Internal::requestCompleted(
            valToString(completionStatus, toe) << endl);
     if (*con_cls) {
         ContentReader *reader = static_cast<ContentReader*>(*con_cls);
+        {
+            std::unique_lock<std::mutex> lock(readersmutex);
+            readers.erase(reader);
+        }
+        auto st = reader->queue.stats();
+        LOGDEB("StreamProxy::requestCompleted: sent " << reader->sent <<
+               " peak buffered " << st.peakbytes << " pauses " <<
+               st.fullcnt << " total buffered " << totalbudget.used() <<
+               " peak " << totalbudget.peak() << endl);
         delete reader;
     }
 }
@@ -18,10 +18,13 @@
 #ifndef _STREAMPROXY_H_INCLUDED_
 #define _STREAMPROXY_H_INCLUDED_
 
+#include <stdint.h>
+
 #include <memory>
 #include <functional>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 class NetFetch;
 
@@ -38,10 +41,13 @@ public:
      * @param queryparams The HTTP query parameters (?nm=value;..)
      * @param[out] fetcher if we are proxying, the fetcher object used 
      *   to get the data. Ownership is transferred to us.
-     * @return one of Error/Proxy/Redirect, dictating how the client request 
-     *      is to be satisfied (or not)
+     * @return one of Error/Proxy/Redirect/LocalFile, dictating how the
+     *      client request is to be satisfied (or not). For LocalFile, url
+     *      was changed to the path of a local file, which we serve
+     *      directly (sendfile) if it is inside one of the directories
+     *      set with addFileRoot().
      */
-    enum UrlTransReturn {Error, Proxy, Redirect};
+    enum UrlTransReturn {Error, Proxy, Redirect, LocalFile};
     typedef std::function<UrlTransReturn
                           (std::string& url,
         const std::unordered_map<std::string, std::string>& queryparams,
@@ -50,6 +56,38 @@ public:
     StreamProxy(int listenport, UrlTransFunc urltrans);
     ~StreamProxy();
 
+    // Requests with this header only have the URL translated (which
+    // may cause it to be cached) and get an empty 204 answer.
+    static const std::string resolveOnlyHeader;
+
+    // Allow serving local files from the dir tree (see LocalFile).
+    void addFileRoot(const std::string& dir);
+
+    // Memory budget in bytes for the proxied data waiting to be sent,
+    // per stream and for all streams. 0 means no limit (the
+    // default). When a stream reaches its budget, or the total one is
+    // used up (a stream can still buffer a small amount in this
+    // case), its transfer from the remote server is paused until the
+    // client catches up.
+    void setBufferBudget(size_t streambytes, size_t totalbytes);
+
+    // Statistics for the active proxied streams. They are also logged
+    // (level 2) every minute while streaming.
+    struct StreamStats {
+        std::string url;
+        // Bytes sent to the client
+        uint64_t sentbytes{0};
+        // Bytes currently buffered, and max reached
+        size_t bufbytes{0};
+        size_t peakbytes{0};
+        // Transfer pause/resume thresholds (0: no limit)
+        size_t hiwater{0};
+        size_t lowater{0};
+        // Count of transfer pauses
+        unsigned int pauses{0};
+    };
+    std::vector<StreamStats> streamStats();
+
     // Debug and experiments: kill connections after ms mS
     void setKillAfterMs(int ms);
     
@@ -25,7 +25,7 @@ import cmdtalkplugin
 import uprclsearch
 import uprclindex
 
-from upmplgutils import uplog, setidprefix
+from upmplgutils import uplog, setidprefix, pagedresult
 from uprclutils import uplog, g_myprefix, rcldirentry, waitentry
 import uprclinit
 
@@ -124,8 +124,7 @@ def browse(a):
             uprclinit.g_dblock.release_read()
 
     #msgproc.log("%s" % entries)
-    encoded = json.dumps(entries)
-    return {"entries" : encoded, "nocache":nocache}
+    return pagedresult(a, entries, nocache, updateid=uprclinit.g_updateid)
 
 
 @dispatcher.record('search')
@@ -149,8 +148,7 @@ def search(a):
     finally:
         uprclinit.g_dblock.release_read()
 
-    encoded = json.dumps(entries)
-    return {"entries" : encoded, "nocache":nocache}
+    return pagedresult(a, entries, nocache, updateid=uprclinit.g_updateid)
 
 
 uprclinit.uprcl_init()
@@ -19,6 +19,7 @@ import conftree
 import threading
 import subprocess
 import time
+import re
 from timeit import default_timer as timer
 
 from rwlock import ReadWriteLock
@@ -33,6 +34,7 @@ from uprclhttp import runbottle
 import minimconfig
 
 from upmplgutils import uplog
+import uprclutils
 from uprclutils import findmyip
 from conftree import stringToStrings
 
@@ -49,6 +51,11 @@ except:
     g_trees = {}
     g_trees_order = ['folders', 'playlists', 'tags', 'untagged']
     g_minimconfig = None
+    # Changed each time the trees are rebuilt, sent with the results
+    # so that upmpdcli can signal the change to the Control Points.
+    # upmpdcli ignores the first value it sees, so we need one for
+    # the placeholder data sent while the first build is running.
+    g_updateid = "init"
 
 def _reset_index():
     _update_index(True)
@@ -64,7 +71,7 @@ def _update_index(rebuild=False):
     # lock. This allows future browse operations to signal the
     # condition to the user instead of blocking (if we kept the write
     # lock).
-    global g_initrunning, g_trees
+    global g_initrunning, g_trees, g_updateid
     g_dblock.acquire_write()
     g_initrunning = "Rebuilding" if rebuild else "Updating"
     g_dblock.release_write()
@@ -89,12 +96,22 @@ def _update_index(rebuild=False):
         newtrees['playlists'] = playlists
         newtrees['tags'] = tagged
         g_trees = newtrees
+        g_updateid = str(int(time.time()))
     finally:
         g_dblock.acquire_write()
         g_initrunning = False
         g_dblock.release_write()
 
 
+# Same as the C++ stringToBool()
+def _strtobool(s):
+    if not s:
+        return False
+    if s[0].isdigit():
+        return int(re.match('[0-9]+', s).group(0)) != 0
+    return s[0] in 'yYtT'
+
+
 # Initialisation runs in a thread because of the possibly long index
 # initialization, during which the main thread can answer
 # "initializing..." to the clients.
@@ -154,6 +171,16 @@ def _uprcl_init_worker():
             pthstr += p + ":" + p + ","
         pthstr = pthstr.rstrip(",")
     uplog("Path translation: pthstr: %s" % pthstr)
+    # The track files are served by the upmpdcli HTTP server (sendfile,
+    # ranges) unless this is disabled or the media directories come
+    # from the Minim config. Keep in sync with plgwithslave.cxx
+    nativestream = g_upconfig.get("uprclnativestream")
+    if (nativestream is None or _strtobool(nativestream)) and \
+       (g_upconfig.get("uprclpaths") or g_upconfig.get("uprclmediadirs")) \
+       and "UPMPD_HTTPHOSTPORT" in os.environ:
+        uprclutils.g_streamhp = os.environ["UPMPD_HTTPHOSTPORT"]
+        uplog("Track files served by upmpdcli on %s" % uprclutils.g_streamhp)
+
     lpth = pthstr.split(',')
     pathmap = {}
     for ptt in lpth:
@@ -80,6 +80,10 @@ upnp2rclfields = {
     'upnp:originalTrackNumber' : 'tracknumber'
     }
 
+# Host:port of the upmpdcli HTTP server if it serves the track files
+# (set by uprclinit), else the tracks are served by our bottle server.
+g_streamhp = None
+
 def _httpurl(httphp, path, query=''):
     return "http://%s%s%s" % (httphp, urlquote(path), query)
 
@@ -148,8 +152,12 @@ def rcldoctoentry(id, pid, httphp, pathprefix, doc):
     ssidx = path.find(b'//')
     if path.find(b'file://') == 0:
         path = path[7:]
-        path = os.path.join(pathprefix.encode('ascii'), path)
-        li['uri'] = _httpurl(httphp, path)
+        if g_streamhp:
+            # The upmpdcli server needs the prefix to dispatch the request
+            li['uri'] = _httpurl(g_streamhp, pathprefix.encode('ascii') + path)
+        else:
+            path = os.path.join(pathprefix.encode('ascii'), path)
+            li['uri'] = _httpurl(httphp, path)
     else:
         li['uri'] = path[:ssidx+2].decode('ascii', errors='replace') +\
                     urlquote(path[ssidx+1:])
@@ -163,11 +171,13 @@ def rcldoctoentry(id, pid, httphp, pathprefix, doc):
 
 
 def rcldirentry(id, pid, title, arturi=None, artist=None, upnpclass=None,
-                searchable='1', date=None):
+                searchable='1', date=None, childcount=None):
     """ Create container entry in format expected by parent """
     #uplog("rcldirentry: id %s pid %s tt %s dte %s clss %s artist %s arturi %s" %
     #      (id,pid,title,date,upnpclass,artist,arturi))
     ret = {'id':id, 'pid':pid, 'tt':title, 'tp':'ct', 'searchable':searchable}
+    if childcount is not None:
+        ret['childcount'] = str(childcount)
     if arturi:
         ret['upnp:albumArtURI'] = arturi
     if artist:
@@ -17,11 +17,22 @@
 
 #include "contentdirectory.hxx"
 
+#include <sys/stat.h>
+#include <time.h>
+
 #include <upnp/upnp.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <utility>
 #include <unordered_map>
 #include <sstream>
@@ -35,6 +46,7 @@
 #include "upmpdutils.hxx"
 #include "main.hxx"
 #include "cdplugins/plgwithslave.hxx"
+#include "cdplugins/sortentries.h"
 #include "conftree.h"
 
 using namespace std;
@@ -44,19 +56,35 @@ using namespace UPnPProvider;
 class ContentDirectory::Internal {
 public:
     Internal (ContentDirectory *sv, MediaServer *dv)
-        : service(sv), msdev(dv), updateID("1") { }
+        : service(sv), msdev(dv),
+          startupdateid((unsigned int)time(0)),
+          systemupdateid(startupdateid) { }
 
     ~Internal() {
-        for (auto& it : plugins) {
-            delete it.second;
+        if (keeper.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(keepermutex);
+                keeperstop = true;
+                keepercond.notify_all();
+            }
+            keeper.join();
         }
     }
 
     // Start plugins which have long init so that the user has less to
     // wait on first access
     void maybeStartSomePlugins(bool enabled);
+    // Background start and periodic check of the plugin processes
+    void keeperLoop(vector<CDPlugin *> plgs);
+    // Wait for ms milliseconds. Returns true if we should stop.
+    bool keeperWait(int ms) {
+        std::unique_lock<std::mutex> lock(keepermutex);
+        return keepercond.wait_for(lock, std::chrono::milliseconds(ms),
+                                   [this] {return keeperstop;});
+    }
 
     void maybeInitUpnpHost() {
+        std::unique_lock<std::mutex> lock(hostmutex);
         if (upnphost.empty()) {
             UpnpDevice *dev;
             if (!service || !(dev = service->getDevice())) {
@@ -81,12 +109,17 @@ public:
         return new PlgWithSlave(appname, service);
     }
 
-    CDPlugin *pluginForApp(const string& appname) {
+    // The map lock is only held for the lookup or creation (which
+    // does not start the plugin process): the plugins handle
+    // concurrent requests by themselves. The plugins are shared with
+    // the root search threads, which may outlive us.
+    std::shared_ptr<CDPlugin> pluginForApp(const string& appname) {
+        std::unique_lock<std::mutex> lock(pluginsmutex);
         auto it = plugins.find(appname);
         if (it != plugins.end()) {
             return it->second;
         } else {
-            CDPlugin *plug = pluginFactory(appname);
+            std::shared_ptr<CDPlugin> plug(pluginFactory(appname));
             if (plug) {
                 plugins[appname] = plug;
             }
@@ -94,12 +127,51 @@ public:
         }
     }
 
+    // Search all the searchable root entries in parallel, and return
+    // the merged result list.
+    std::shared_ptr<const vector<UpSong>> rootSearch(
+        const string& searchstr, const vector<string>& sortcrits);
+
     ContentDirectory *service;
     MediaServer *msdev;
-    unordered_map<string, CDPlugin *> plugins;
+    std::mutex pluginsmutex;
+    unordered_map<string, std::shared_ptr<CDPlugin> > plugins;
+    std::mutex hostmutex;
     string upnphost;
     int upnpport;
-    string updateID;
+
+    // Update ids. The initial value is the startup time, so that
+    // the Control Points do not keep the data cached from a previous
+    // run. Containers which were never signaled as changed have the
+    // initial value, or their plugin root value.
+    unsigned int containerUpdateID(const string& objid);
+    void contentChanged(const string& objid);
+    // Check if the root directory was rebuilt
+    void checkRootChange();
+    std::mutex updmutex;
+    unsigned int startupdateid;
+    unsigned int systemupdateid;
+    unordered_map<string, unsigned int> containerupdateids;
+    // Changed containers since the last event
+    set<string> changedcontainers;
+    unsigned int eventedsystemupdateid{0};
+    unsigned int rootbuildsseen{0};
+
+    // Merged root search results, kept for paging.
+    struct RootSearchCacheEntry {
+        std::shared_ptr<const vector<UpSong>> entries;
+        time_t expires;
+    };
+    std::mutex rscachemutex;
+    map<string, RootSearchCacheEntry> rscache;
+    // Per-service flags, set while a root search thread is running.
+    // Protected by rscachemutex.
+    unordered_map<string, std::shared_ptr<std::atomic<bool> > > rsbusy;
+
+    std::thread keeper;
+    std::mutex keepermutex;
+    std::condition_variable keepercond;
+    bool keeperstop{false};
 };
 
 static const string
@@ -149,7 +221,7 @@ int ContentDirectory::actGetSortCapabilities(const SoapIncoming& sc, SoapOutgoin
 {
     LOGDEB("ContentDirectory::actGetSortCapabilities: " << endl);
 
-    std::string out_SortCaps;
+    std::string out_SortCaps(sortCapabilities());
     data.addarg("SortCaps", out_SortCaps);
     return UPNP_E_SUCCESS;
 }
@@ -158,15 +230,115 @@ int ContentDirectory::actGetSystemUpdateID(const SoapIncoming& sc, SoapOutgoing&
 {
     LOGDEB("ContentDirectory::actGetSystemUpdateID: " << endl);
 
-    std::string out_Id = m->updateID;
+    std::string out_Id;
+    {
+        std::unique_lock<std::mutex> lock(m->updmutex);
+        out_Id = ulltodecstr(m->systemupdateid);
+    }
     data.addarg("Id", out_Id);
     return UPNP_E_SUCCESS;
 }
 
+void ContentDirectory::contentChanged(const string& objid)
+{
+    m->contentChanged(objid);
+}
+
+// Commas inside the ids are escaped in the CSV list
+static string csvescape(const string& in)
+{
+    string out;
+    for (auto c : in) {
+        if (c == ',' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+bool ContentDirectory::getEventData(bool all, std::vector<std::string>& names,
+                                    std::vector<std::string>& values)
+{
+    std::unique_lock<std::mutex> lock(m->updmutex);
+    if (all || m->systemupdateid != m->eventedsystemupdateid) {
+        names.push_back("SystemUpdateID");
+        values.push_back(ulltodecstr(m->systemupdateid));
+        m->eventedsystemupdateid = m->systemupdateid;
+    }
+    if (all || !m->changedcontainers.empty()) {
+        string ids;
+        for (const auto& id : m->changedcontainers) {
+            if (!ids.empty()) {
+                ids += ',';
+            }
+            ids += csvescape(id) + "," +
+                ulltodecstr(m->containerupdateids[id]);
+        }
+        m->changedcontainers.clear();
+        names.push_back("ContainerUpdateIDs");
+        values.push_back(ids);
+    }
+    if (all) {
+        names.push_back("TransferIDs");
+        values.push_back("");
+    }
+    return true;
+}
+
+// The root directory is built at startup (mediaServerNeeded()), or
+// on first access, and rebuilt if the configuration file is
+// modified. The DIDL data is rendered once: root Browse requests
+// just copy a slice. The root entries have none of the optional
+// properties, so that the Filter does not change the data.
+//
+// Only the root entries (which services are listed, and their titles)
+// follow the configuration edits: g_config is not reloaded, and the
+// plugins, which read it when they are created, keep the startup
+// values (credentials, proxy and cache parameters...). A service
+// added to the configuration is listed, but it will only work with
+// the new parameters after a restart.
 static vector<UpSong> rootdir;
-static bool makerootdir()
+static string rootdidl;
+// Entry i is the [rootoffsets[i], rootoffsets[i+1]) slice of rootdidl
+static vector<size_t> rootoffsets;
+// Configuration file modification time when the root was built
+static time_t rootconfmtime;
+// Count of root builds, for detecting changes
+static unsigned int rootbuilds;
+static std::mutex rootmutex;
+
+static time_t configmtime()
+{
+    struct stat st;
+    if (g_configfilename.empty() || stat(g_configfilename.c_str(), &st)) {
+        return 0;
+    }
+    return st.st_mtime;
+}
+
+static bool makerootdir_locked()
 {
     rootdir.clear();
+    rootdidl.clear();
+    rootoffsets.clear();
+    rootconfmtime = configmtime();
+    rootbuilds++;
+    // g_config is not reloaded (see above). Use a fresh copy for the
+    // root entries if the file changed since we started.
+    std::unique_ptr<ConfSimple> fresh;
+    ConfSimple *config = g_config;
+    if (g_config->sourceChanged()) {
+        fresh = std::unique_ptr<ConfSimple>(
+            new ConfSimple(g_configfilename.c_str(), 1, true));
+        if (fresh->ok()) {
+            LOGINF("ContentDirectory::makerootdir: configuration changed. "
+                   "Updating the root directory only, restart to apply the "
+                   "service parameters\n");
+            config = fresh.get();
+        }
+    }
+
     string pathplg = path_cat(g_datadir, "cdplugins");
     string reason;
     set<string> entries;
@@ -182,8 +354,8 @@ static bool makerootdir()
         }
         string userkey = entry + "user";
         string autostartkey = entry + "autostart";
-        if (!g_config->hasNameAnywhere(userkey) &&
-            !g_config->hasNameAnywhere(autostartkey)) {
+        if (!config->hasNameAnywhere(userkey) &&
+            !config->hasNameAnywhere(autostartkey)) {
             LOGINF("ContentDirectory: not creating entry for " << entry <<
                    " because neither " << userkey << " nor " << autostartkey <<
                    " are defined in the configuration\n");
@@ -194,35 +366,47 @@ static bool makerootdir()
         // we compute a title (to be displayed in the root directory)
         // from the plugin name.
         string title;
-        if (!g_config->get(entry + "title", title)) {
+        if (!config->get(entry + "title", title)) {
             title = stringtoupper((const string&)entry.substr(0,1)) +
                 entry.substr(1, entry.size()-1);
         }
         rootdir.push_back(UpSong::container("0$" + entry + "$", "0", title));
     }
 
+    bool ret = true;
     if (rootdir.empty()) {
         // This should not happen, as we only start the CD if services
         // are configured !
         rootdir.push_back(UpSong::item("0$none$", "0", "No services found"));
-        return false;
-    } else {
-        return true;
+        ret = false;
+    }
+    for (const auto& entry : rootdir) {
+        rootoffsets.push_back(rootdidl.size());
+        entry.didl(rootdidl);
+    }
+    rootoffsets.push_back(rootdidl.size());
+    return ret;
+}
+
+static void maybemakerootdir_locked()
+{
+    if (rootdir.empty() || configmtime() != rootconfmtime) {
+        makerootdir_locked();
     }
 }
 
 bool ContentDirectory::mediaServerNeeded()
 {
-    return makerootdir();
+    std::unique_lock<std::mutex> lock(rootmutex);
+    return makerootdir_locked();
 }
 
 // Returns totalmatches
 static size_t readroot(int offs, int cnt, vector<UpSong>& out)
 {
     //LOGDEB("readroot: offs " << offs << " cnt " << cnt << endl);
-    if (rootdir.empty()) {
-        makerootdir();
-    }
+    std::unique_lock<std::mutex> lock(rootmutex);
+    maybemakerootdir_locked();
     out.clear();
     if (cnt <= 0)
         cnt = rootdir.size();
@@ -242,6 +426,82 @@ static size_t readroot(int offs, int cnt, vector<UpSong>& out)
     return rootdir.size();
 }
 
+// Output a slice of the root directory from the rendered data.
+// Returns totalmatches
+static size_t readrootdidl(int offs, int cnt, CDResultSink& sink)
+{
+    std::unique_lock<std::mutex> lock(rootmutex);
+    maybemakerootdir_locked();
+    size_t start = offs > 0 ? std::min(size_t(offs), rootdir.size()) : 0;
+    size_t end = cnt > 0 ? std::min(start + cnt, rootdir.size()) :
+        rootdir.size();
+    if (sink.didlProps()) {
+        sink.addDidl(rootdidl.data() + rootoffsets[start],
+                     rootoffsets[end] - rootoffsets[start], end - start);
+    } else {
+        for (size_t i = start; i < end; i++) {
+            sink.add(rootdir[i]);
+        }
+    }
+    return rootdir.size();
+}
+
+unsigned int ContentDirectory::Internal::containerUpdateID(
+    const string& objid)
+{
+    std::unique_lock<std::mutex> lock(updmutex);
+    if (!objid.compare("0")) {
+        // Anything may have changed below
+        return systemupdateid;
+    }
+    auto it = containerupdateids.find(objid);
+    if (it != containerupdateids.end()) {
+        return it->second;
+    }
+    // Plugin root: 0$app$
+    string::size_type dol = objid.find('$', 2);
+    if (dol != string::npos) {
+        it = containerupdateids.find(objid.substr(0, dol + 1));
+        if (it != containerupdateids.end()) {
+            return it->second;
+        }
+    }
+    return startupdateid;
+}
+
+void ContentDirectory::Internal::contentChanged(const string& objid)
+{
+    {
+        std::unique_lock<std::mutex> lock(updmutex);
+        systemupdateid++;
+        containerupdateids[objid] = systemupdateid;
+        changedcontainers.insert(objid);
+        LOGDEB("ContentDirectory::contentChanged: " << objid << " -> " <<
+               systemupdateid << endl);
+    }
+    if (msdev) {
+        msdev->loopWakeup();
+    }
+}
+
+void ContentDirectory::Internal::checkRootChange()
+{
+    unsigned int builds;
+    {
+        std::unique_lock<std::mutex> lock(rootmutex);
+        builds = rootbuilds;
+    }
+    bool changed;
+    {
+        std::unique_lock<std::mutex> lock(updmutex);
+        changed = rootbuildsseen != 0 && rootbuildsseen != builds;
+        rootbuildsseen = builds;
+    }
+    if (changed) {
+        contentChanged("0");
+    }
+}
+
 static string appForId(const string& id)
 {
     string app;
@@ -258,6 +518,169 @@ static string appForId(const string& id)
     return id.substr(dol0 + 1, dol1 - dol0 -1);
 }
 
+// Root search. The query is passed to all the searchable services in
+// parallel, and the results are concatenated in root directory order.
+//
+// Each service search runs in its own detached thread, so that a slow
+// service does not hold up the request past the deadline
+// (plgrootsearchtimeout): its results are just dropped when they come
+// in late. The state and the plugin are shared with the threads, which
+// may outlive the request. A service which is still busy with a
+// previous root search is skipped, so that there is at most one
+// thread per service stuck on a hung slave.
+//
+// The merged list is cached so that the following pages do not cause
+// new searches. Incomplete results are only kept for a short time.
+
+// Max number of entries we ask from each service.
+static const int rootsearchplgmax = 200;
+// Cache retention for complete and incomplete results.
+static const int rootsearchttl = 300;
+static const int rootsearchpartialttl = 30;
+static const size_t rootsearchcachesize = 20;
+
+class RootSearchState {
+public:
+    RootSearchState(size_t n)
+        : parts(n), done(n, false) {}
+    std::mutex mutex;
+    std::condition_variable cond;
+    vector<vector<UpSong>> parts;
+    vector<bool> done;
+    size_t ndone{0};
+};
+
+std::shared_ptr<const vector<UpSong>>
+ContentDirectory::Internal::rootSearch(const string& searchstr,
+                                       const vector<string>& sortcrits)
+{
+    string cachekey = sortCritsKey(sortcrits) + ":" + searchstr;
+    time_t now = time(0);
+    {
+        std::unique_lock<std::mutex> lock(rscachemutex);
+        auto it = rscache.find(cachekey);
+        if (it != rscache.end()) {
+            if (it->second.expires > now) {
+                LOGDEB("ContentDirectory::rootSearch: cached\n");
+                return it->second.entries;
+            }
+            rscache.erase(it);
+        }
+    }
+
+    vector<UpSong> rootentries;
+    readroot(0, 0, rootentries);
+    vector<std::shared_ptr<CDPlugin> > plgs;
+    vector<std::shared_ptr<std::atomic<bool> > > busyflags;
+    bool allasked = true;
+    for (const auto& entry : rootentries) {
+        if (!entry.iscontainer || !entry.searchable) {
+            continue;
+        }
+        std::shared_ptr<CDPlugin> plg = pluginForApp(appForId(entry.id));
+        if (!plg) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(rscachemutex);
+        auto& busy = rsbusy[plg->getname()];
+        if (!busy) {
+            busy = std::make_shared<std::atomic<bool> >(false);
+        }
+        if (busy->exchange(true)) {
+            LOGERR("ContentDirectory::rootSearch: " << plg->getname() <<
+                   " still busy with a previous search\n");
+            allasked = false;
+            continue;
+        }
+        plgs.push_back(plg);
+        busyflags.push_back(busy);
+    }
+
+    int timeoutsecs = 10;
+    string value;
+    if (g_config->get("plgrootsearchtimeout", value)) {
+        timeoutsecs = atoi(value.c_str());
+    }
+
+    auto state = std::make_shared<RootSearchState>(plgs.size());
+    for (size_t i = 0; i < plgs.size(); i++) {
+        std::shared_ptr<CDPlugin> plg = plgs[i];
+        std::shared_ptr<std::atomic<bool> > busy = busyflags[i];
+        std::thread([state, i, plg, busy, searchstr, sortcrits] () {
+                vector<UpSong> entries;
+                CDVectorSink sink(entries);
+                plg->search(string("0$") + plg->getname() + "$", 0,
+                            rootsearchplgmax, searchstr, sink, sortcrits);
+                *busy = false;
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->parts[i].swap(entries);
+                state->done[i] = true;
+                state->ndone++;
+                state->cond.notify_all();
+            }).detach();
+    }
+
+    auto result = std::make_shared<vector<UpSong>>();
+    bool complete;
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::seconds(timeoutsecs);
+        complete = state->cond.wait_until(
+            lock, deadline, [&state] {
+                return state->ndone == state->parts.size();}) && allasked;
+        for (size_t i = 0; i < plgs.size(); i++) {
+            if (!state->done[i]) {
+                LOGERR("ContentDirectory::rootSearch: " << plgs[i]->getname()
+                       << " timed out\n");
+                continue;
+            }
+            // Service errors are reported as a single bogus item in
+            // the search container: don't mix them in.
+            string ctid = string("0$") + plgs[i]->getname() + "$";
+            for (auto& entry : state->parts[i]) {
+                if (!entry.iscontainer && entry.parentid == ctid &&
+                    entry.id == ctid + "$bogus") {
+                    continue;
+                }
+                result->push_back(std::move(entry));
+            }
+            state->parts[i].clear();
+        }
+    }
+    // The services sorted their own results, but we need to sort the
+    // merged list.
+    string critskey = sortCritsKey(sortcrits);
+    if (!critskey.empty()) {
+        vector<int> perm;
+        sortPermutation(*result, critskey, perm);
+        auto sorted = std::make_shared<vector<UpSong>>();
+        sorted->reserve(perm.size());
+        for (auto i : perm) {
+            sorted->push_back(std::move((*result)[i]));
+        }
+        result = sorted;
+    }
+    LOGDEB("ContentDirectory::rootSearch: " << result->size() <<
+           " entries from " << state->ndone << "/" << plgs.size() <<
+           " services\n");
+
+    std::unique_lock<std::mutex> lock(rscachemutex);
+    if (rscache.size() >= rootsearchcachesize) {
+        // Drop the entry closest to expiry
+        auto oldest = rscache.begin();
+        for (auto it = rscache.begin(); it != rscache.end(); it++) {
+            if (it->second.expires < oldest->second.expires) {
+                oldest = it;
+            }
+        }
+        rscache.erase(oldest);
+    }
+    rscache[cachekey] = RootSearchCacheEntry{
+        result, now + (complete ? rootsearchttl : rootsearchpartialttl)};
+    return result;
+}
+
 
 void ContentDirectory::Internal::maybeStartSomePlugins(bool enabled)
 {
@@ -275,27 +698,78 @@ void ContentDirectory::Internal::maybeStartSomePlugins(bool enabled)
     // Proxy. Only inconvenient is that it opens one more port. 
     // This is rather messy.
     PlgWithSlave::maybeStartProxy(this->service);
-    
-    for (auto& entry : rootdir) {
+
+    // Plugins with the autostart flag are always started. With
+    // plgprestart, all the configured plugins are.
+    bool all = false;
+    string value;
+    if (g_config->get("plgprestart", value)) {
+        all = stringToBool(value);
+    }
+    vector<CDPlugin *> plgs;
+    vector<UpSong> entries;
+    readroot(0, 0, entries);
+    for (auto& entry : entries) {
+        if (!entry.iscontainer) {
+            continue;
+        }
         string app = appForId(entry.id);
         string sas;
-        if (g_config->get(app + "autostart", sas) && stringToBool(sas)) {
+        if (all ||
+            (g_config->get(app + "autostart", sas) && stringToBool(sas))) {
             LOGDEB0("ContentDirectory::Internal::maybeStartSomePlugins: "
                     "starting " << app << endl);
-            CDPlugin *p = pluginForApp(app);
+            CDPlugin *p = pluginForApp(app).get();
             if (p) {
-                p->startInit();
+                plgs.push_back(p);
             }
         }
     }
+    if (!plgs.empty()) {
+        keeper = std::thread(&Internal::keeperLoop, this, plgs);
+    }
 }
 
-// Really preposterous: bubble (and maybe others) searches in root,
-// but we can't do this. So memorize the last browsed object ID and
-// use this as a replacement when root search is requested. Forget
-// about multiaccess, god forbid multithreading etc. Will work in most
-// cases though :)
-static string last_objid;
+// The plugins are started in parallel, but with a delay between
+// them, so that the Python startups do not all compete for the CPU on
+// small machines. After this, we periodically check that the slave
+// processes are still alive, and restart them if needed, so that a
+// user request does not have to.
+void ContentDirectory::Internal::keeperLoop(vector<CDPlugin *> plgs)
+{
+    int staggerms = 1000;
+    int checksecs = 60;
+    string value;
+    if (g_config->get("plgprestartdelay", value)) {
+        staggerms = atoi(value.c_str());
+    }
+    if (g_config->get("plgcheckinterval", value)) {
+        checksecs = atoi(value.c_str());
+    }
+
+    vector<std::thread> starters;
+    for (size_t i = 0; i < plgs.size(); i++) {
+        if (i > 0 && staggerms > 0 && keeperWait(staggerms)) {
+            break;
+        }
+        CDPlugin *p = plgs[i];
+        starters.push_back(std::thread([p] () {
+                    if (!p->startInit()) {
+                        LOGERR("ContentDirectory: could not start " <<
+                               p->getname() << endl);
+                    }
+                }));
+    }
+    for (auto& t : starters) {
+        t.join();
+    }
+
+    while (checksecs > 0 && !keeperWait(checksecs * 1000)) {
+        for (auto p : plgs) {
+            p->startInit();
+        }
+    }
+}
 
 int ContentDirectory::actBrowse(const SoapIncoming& sc, SoapOutgoing& data)
 {
@@ -343,8 +817,6 @@ int ContentDirectory::actBrowse(const SoapIncoming& sc, SoapOutgoing& data)
            " RequestedCount " << in_RequestedCount <<
            " SortCriteria " << in_SortCriteria << endl);
 
-    last_objid = in_ObjectID;
-    
     vector<string> sortcrits;
     stringToStrings(in_SortCriteria, sortcrits);
 
@@ -359,35 +831,32 @@ int ContentDirectory::actBrowse(const SoapIncoming& sc, SoapOutgoing& data)
     std::string out_TotalMatches;
     std::string out_UpdateID;
 
-    // Go fetch
-    vector<UpSong> entries;
+    // Go fetch. The entries are directly rendered into the result.
+    CDDidlSink sink(out_Result, UpSong::parseFilter(in_Filter));
     size_t totalmatches = 0;
     if (!in_ObjectID.compare("0")) {
         // Root directory: we do this ourselves
-        totalmatches = readroot(in_StartingIndex, in_RequestedCount, entries);
+        totalmatches = readrootdidl(in_StartingIndex, in_RequestedCount, sink);
+        m->checkRootChange();
     } else {
         // Pass off request to appropriate app, defined by 1st elt in id
         string app = appForId(in_ObjectID);
-        CDPlugin *plg = m->pluginForApp(app);
+        std::shared_ptr<CDPlugin> plg = m->pluginForApp(app);
         if (plg) {
             totalmatches = plg->browse(in_ObjectID, in_StartingIndex,
-                                       in_RequestedCount, entries,
+                                       in_RequestedCount, sink,
                                        sortcrits, bf);
         } else {
             LOGERR("ContentDirectory::Browse: unknown app: [" << app << "]\n");
             return UPNP_E_INVALID_PARAM;
         }
     }
+    sink.close();
 
     // Process and send out result
-    out_NumberReturned = ulltodecstr(entries.size());
+    out_NumberReturned = ulltodecstr(sink.count());
     out_TotalMatches = ulltodecstr(totalmatches);
-    out_UpdateID = m->updateID;
-    out_Result = headDIDL();
-    for (unsigned int i = 0; i < entries.size(); i++) {
-        out_Result += entries[i].didl();
-    } 
-    out_Result += tailDIDL();
+    out_UpdateID = ulltodecstr(m->containerUpdateID(in_ObjectID));
     LOGDEB1("ContentDirectory::Browse: didl: " << out_Result << endl);
     
     data.addarg("Result", out_Result);
@@ -454,38 +923,39 @@ int ContentDirectory::actSearch(const SoapIncoming& sc, SoapOutgoing& data)
     std::string out_UpdateID;
 
     // Go fetch
-    vector<UpSong> entries;
+    CDDidlSink sink(out_Result, UpSong::parseFilter(in_Filter));
     size_t totalmatches = 0;
     if (!in_ContainerID.compare("0")) {
-        // Root directory: can't search in there: we don't know what
-        // plugin to pass the search to. Substitute last browsed. Yes
-        // it does break in multiuser mode, and yes it's preposterous.
-        LOGERR("ContentDirectory::actSearch: Can't search in root. "
-               "Substituting last browsed container\n");
-        in_ContainerID = last_objid;
-    }
-
-    // Pass off request to appropriate app, defined by 1st elt in id
-    string app = appForId(in_ContainerID);
-    CDPlugin *plg = m->pluginForApp(app);
-    if (plg) {
-        totalmatches = plg->search(in_ContainerID, in_StartingIndex,
-                                   in_RequestedCount, in_SearchCriteria,
-                                   entries, sortcrits);
+        // Root directory: search all the services and merge.
+        auto entries = m->rootSearch(in_SearchCriteria, sortcrits);
+        totalmatches = entries->size();
+        if (in_StartingIndex >= 0) {
+            size_t cnt = in_RequestedCount > 0 ?
+                size_t(in_RequestedCount) : entries->size();
+            for (size_t i = in_StartingIndex;
+                 i < entries->size() && size_t(sink.count()) < cnt; i++) {
+                sink.add((*entries)[i]);
+            }
+        }
     } else {
-        LOGERR("ContentDirectory::Search: unknown app: [" << app << "]\n");
-        return UPNP_E_INVALID_PARAM;
+        // Pass off request to appropriate app, defined by 1st elt in id
+        string app = appForId(in_ContainerID);
+        std::shared_ptr<CDPlugin> plg = m->pluginForApp(app);
+        if (plg) {
+            totalmatches = plg->search(in_ContainerID, in_StartingIndex,
+                                       in_RequestedCount, in_SearchCriteria,
+                                       sink, sortcrits);
+        } else {
+            LOGERR("ContentDirectory::Search: unknown app: [" << app << "]\n");
+            return UPNP_E_INVALID_PARAM;
+        }
     }
+    sink.close();
 
     // Process and send out result
-    out_NumberReturned = ulltodecstr(entries.size());
+    out_NumberReturned = ulltodecstr(sink.count());
     out_TotalMatches = ulltodecstr(totalmatches);
-    out_UpdateID = m->updateID;
-    out_Result = headDIDL();
-    for (unsigned int i = 0; i < entries.size(); i++) {
-        out_Result += entries[i].didl();
-    } 
-    out_Result += tailDIDL();
+    out_UpdateID = ulltodecstr(m->containerUpdateID(in_ContainerID));
     
     data.addarg("Result", out_Result);
     data.addarg("NumberReturned", out_NumberReturned);
@@ -519,17 +989,19 @@ static string firstpathelt(const string& path)
 CDPlugin *ContentDirectory::getpluginforpath(const string& path)
 {
     string app = firstpathelt(path);
-    return m->pluginForApp(app);
+    return m->pluginForApp(app).get();
 }
 
 std::string ContentDirectory::getupnpaddr(CDPlugin *)
 {
+    std::unique_lock<std::mutex> lock(m->hostmutex);
     return m->upnphost;
 }
 
 
 int ContentDirectory::getupnpport(CDPlugin *)
 {
+    std::unique_lock<std::mutex> lock(m->hostmutex);
     return m->upnpport;
 }
 
@@ -549,6 +1021,7 @@ string ContentDirectory::microhttphost()
         return host;
     }
     m->maybeInitUpnpHost();
+    std::unique_lock<std::mutex> lock(m->hostmutex);
     return m->upnphost;
 }
 
@@ -93,6 +93,13 @@ public:
     /// UPnP host, but can be forced in the configuration. The
     /// microhttp server listens on all addresses.
     virtual std::string microhttphost();
+    /// Update the SystemUpdateID and the container update id, and
+    /// event them.
+    virtual void contentChanged(const std::string& objid);
+
+    /// UpnpService method: return the changed state variables
+    virtual bool getEventData(bool all, std::vector<std::string>& names,
+                              std::vector<std::string>& values);
     
 private:
     int actGetSearchCapabilities(const SoapIncoming& sc, SoapOutgoing& data);
@@ -33,6 +33,7 @@
 #include "conftree.h"
 #include "execmd.h"
 #include "upmpdutils.hxx"
+#include "nexturlhint.hxx"
 
 struct mpd_status;
 
@@ -280,6 +281,11 @@ bool MPDCli::updStatus()
 
     m_stat.songelapsedms = mpd_status_get_elapsed_ms(mpds);
     m_stat.songlenms = mpd_status_get_total_time(mpds) * 1000;
+    if (m_stat.state == MpdStatus::MPDS_PLAY && m_stat.songpos >= 0 &&
+        m_stat.songlenms > m_stat.songelapsedms) {
+        nextUrlHint(m_stat.nextsong.rsrc.uri,
+                    m_stat.songlenms - m_stat.songelapsedms);
+    }
     m_stat.kbrate = mpd_status_get_kbit_rate(mpds);
     const struct mpd_audio_format *maf = 
         mpd_status_get_audio_format(mpds);
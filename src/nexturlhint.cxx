@@ -0,0 +1,129 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *       This program is free software; you can redistribute it and/or modify
+ *       it under the terms of the GNU Lesser General Public License as published by
+ *       the Free Software Foundation; either version 2.1 of the License, or
+ *       (at your option) any later version.
+ *
+ *       This program is distributed in the hope that it will be useful,
+ *       but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *       GNU Lesser General Public License for more details.
+ *
+ *       You should have received a copy of the GNU Lesser General Public License
+ *       along with this program; if not, write to the
+ *       Free Software Foundation, Inc.,
+ *       59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "nexturlhint.hxx"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <mutex>
+
+#include <curl/curl.h>
+
+#include "libupnpp/log.hxx"
+
+#include "main.hxx"
+#include "conftree.h"
+#include "smallut.h"
+#include "workqueue.h"
+#include "mediaserver/cdplugins/cdplugin.hxx"
+#include "mediaserver/cdplugins/streamproxy.h"
+
+using namespace std;
+
+// Only the last hint matters: the queue is flushed on each put.
+static WorkQueue<string> hintqueue("NextUrlHint", 1);
+static string lasthint;
+static time_t lasthinttime;
+static mutex hintmutex;
+// Seconds before the end of the current track. 0 if disabled
+static unsigned int hintsecs;
+static string proxyport;
+
+static void *hintWorker(void *)
+{
+    for (;;) {
+        string uri;
+        if (!hintqueue.take(&uri)) {
+            hintqueue.workerExit();
+            return (void*)1;
+        }
+        LOGDEB("nextUrlHint: requesting " << uri << endl);
+        CURL *curl = curl_easy_init();
+        if (nullptr == curl) {
+            LOGERR("nextUrlHint: curl_easy_init failed\n");
+            continue;
+        }
+        struct curl_slist *headers =
+            curl_slist_append(nullptr, (StreamProxy::resolveOnlyHeader + ": 1").c_str());
+        curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        CURLcode code = curl_easy_perform(curl);
+        if (code != CURLE_OK) {
+            LOGDEB("nextUrlHint: " << curl_easy_strerror(code) << endl);
+        }
+        curl_slist_free_all(headers);
+        curl_easy_cleanup(curl);
+    }
+}
+
+static void init()
+{
+    string val;
+    if (g_config && g_config->get("plgresolvenext", val)) {
+        hintsecs = atoi(val.c_str());
+    }
+    if (hintsecs == 0) {
+        return;
+    }
+    proxyport = string(":") +
+        lltodecstr(CDPluginServices::microhttpport()) + "/";
+    if (!hintqueue.start(1, hintWorker, nullptr)) {
+        LOGERR("nextUrlHint: could not start worker thread\n");
+        hintsecs = 0;
+    }
+}
+
+// Does the URI point to our proxy ? The host part may be any of our
+// addresses, so we only check the port.
+static bool isProxyUri(const string& uri)
+{
+    if (uri.compare(0, 7, "http://")) {
+        return false;
+    }
+    string::size_type pos = uri.find('/', 7);
+    if (pos == string::npos) {
+        return false;
+    }
+    string::size_type colon = uri.rfind(':', pos);
+    return colon != string::npos && colon > 7 &&
+        !uri.compare(colon, proxyport.size(), proxyport);
+}
+
+void nextUrlHint(const string& uri, unsigned int remainingms)
+{
+    static std::once_flag once;
+    std::call_once(once, init);
+    if (hintsecs == 0 || uri.empty() || remainingms > hintsecs * 1000) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(hintmutex);
+        time_t now = time(0);
+        if (uri == lasthint && now - lasthinttime < 60) {
+            return;
+        }
+        lasthint = uri;
+        lasthinttime = now;
+    }
+    if (isProxyUri(uri)) {
+        hintqueue.put(uri, true);
+    }
+}
@@ -0,0 +1,40 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *       This program is free software; you can redistribute it and/or modify
+ *       it under the terms of the GNU Lesser General Public License as published by
+ *       the Free Software Foundation; either version 2.1 of the License, or
+ *       (at your option) any later version.
+ *
+ *       This program is distributed in the hope that it will be useful,
+ *       but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *       GNU Lesser General Public License for more details.
+ *
+ *       You should have received a copy of the GNU Lesser General Public License
+ *       along with this program; if not, write to the
+ *       Free Software Foundation, Inc.,
+ *       59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _NEXTURLHINT_H_X_INCLUDED_
+#define _NEXTURLHINT_H_X_INCLUDED_
+
+#include <string>
+
+// Advance notice of the next track URI to the media server plugins.
+//
+// When the next track in the MPD queue is a streaming service track
+// served by our media server proxy, the real media URL has to be
+// obtained from the service when MPD opens it, which can take a
+// second or two. If enabled (plgresolvenext), we send a HEAD request
+// marked with a special header to the proxy a few seconds before the
+// end of the current track. The proxy performs the translation, which
+// is then cached (see PlgWithSlave::get_media_url()), and does not
+// open the upstream connection. This goes through HTTP because the
+// media server may run in a separate process.
+//
+// This is called from the MPD status update, with the remaining time
+// for the current track, and returns at once: the request is
+// performed by a worker thread. Repeated calls for the same URI are
+// ignored.
+extern void nextUrlHint(const std::string& uri, unsigned int remainingms);
+
+#endif /* _NEXTURLHINT_H_X_INCLUDED_ */
@@ -27,7 +27,6 @@
 #include <utility>
 #include <vector>
 
-#include "libupnpp/base64.hxx"
 #include "libupnpp/log.hxx"
 #include "libupnpp/soaphelp.hxx"
 #include "libupnpp/upnpavutils.hxx"
@@ -37,6 +36,7 @@
 #include "upmpd.hxx"
 #include "upmpdutils.hxx"
 #include "smallut.h"
+#include "textkern.h"
 #include "ohproduct.hxx"
 #include "protocolinfo.hxx"
 #include "pathut.h"
@@ -148,7 +148,25 @@ static string translateIdArray(const vector<UpSong>& in)
         sdeb += SoapHelp::i2s(val) + " ";
     }
     LOGDEB("OHPlaylist::translateIdArray: current ids: " << sdeb << endl);
-    return base64_encode(out1);
+    return base64Encode(out1);
+}
+
+// Reverse of translateIdArray()
+static bool idArrayToVec(const string& in, vector<int>& ids)
+{
+    string data;
+    if (!base64Decode(in, data) || data.size() % 4) {
+        LOGERR("OHPlaylist::idArrayToVec: bad id array\n");
+        return false;
+    }
+    ids.clear();
+    ids.reserve(data.size() / 4);
+    const unsigned char *cp = (const unsigned char *)data.c_str();
+    for (unsigned int i = 0; i < data.size(); i += 4) {
+        ids.push_back((cp[i] << 24) | (cp[i+1] << 16) | (cp[i+2] << 8) |
+                      cp[i+3]);
+    }
+    return true;
 }
 
 bool OHPlaylist::makeIdArray(string& out)
@@ -604,7 +622,7 @@ int OHPlaylist::ohread(const SoapIncoming& sc, SoapOutgoing& data)
             return UPNP_E_INTERNAL_ERROR;
         }
     }
-    data.addarg("Uri", SoapHelp::xmlQuote(song.rsrc.uri));
+    data.addarg("Uri", xmlEscape(song.rsrc.uri));
     data.addarg("Metadata", metadata);
     return UPNP_E_SUCCESS;
 }
@@ -648,14 +666,14 @@ int OHPlaylist::readList(const SoapIncoming& sc, SoapOutgoing& data)
                 if (mit != m_metacache.end()) {
                     LOGDEB1("OHPlaylist::readList: meta for id " << id << " uri "
                             << song.rsrc.uri << " found in cache " << endl);
-                    metadata = SoapHelp::xmlQuote(mit->second);
+                    metadata = xmlEscape(mit->second);
                 } else {
                     LOGDEB("OHPlaylist::readList: meta for id " << id << " uri "
                            << song.rsrc.uri << " not found " << endl);
                     metadata = didlmake(song);
                     m_metacache[song.rsrc.uri] = metadata;
                     m_cachedirty = true;
-                    metadata = SoapHelp::xmlQuote(metadata);
+                    metadata = xmlEscape(metadata);
                 }
             } else {
                 LOGDEB("OHPlaylist::readList: not active: using saved queue\n");
@@ -671,9 +689,9 @@ int OHPlaylist::readList(const SoapIncoming& sc, SoapOutgoing& data)
                 }
             }
             out += "<Entry><Id>";
-            out += SoapHelp::xmlQuote(it->c_str());
+            xmlEscapeAppend(*it, out);
             out += "</Id><Uri>";
-            out += SoapHelp::xmlQuote(song.rsrc.uri);
+            xmlEscapeAppend(song.rsrc.uri, out);
             out += "</Uri><Metadata>";
             out += metadata;
             out += "</Metadata></Entry>";
@@ -869,7 +887,7 @@ bool OHPlaylist::urlMap(unordered_map<int, string>& umap)
     string sarray; 
     if (iidArray(sarray, 0)) {
         vector<int> ids;
-        if (ohplIdArrayToVec(sarray, &ids)) {
+        if (idArrayToVec(sarray, ids)) {
             vector<UpSong> songs;
             if (ireadList(ids, songs)) {
                 for (auto it = songs.begin(); it != songs.end(); it++) {
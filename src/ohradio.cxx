@@ -29,7 +29,6 @@
 #include <vector>
 #include <json/json.h>
 
-#include "libupnpp/base64.hxx"
 #include "libupnpp/log.hxx"
 #include "libupnpp/soaphelp.hxx"
 #include "libupnpp/upnpavutils.hxx"
@@ -38,6 +37,7 @@
 #include "mpdcli.hxx"
 #include "upmpd.hxx"
 #include "smallut.h"
+#include "textkern.h"
 #include "pathut.h"
 #include "upmpdutils.hxx"
 #include "conftree.h"
@@ -253,7 +253,7 @@ bool OHRadio::makeIdArray(string& out)
         out1 += (unsigned char) ((val & 0x0000ff00) >> 8);
         out1 += (unsigned char) ((val & 0x000000ff));
     }
-    out = base64_encode(out1);
+    out = base64Encode(out1);
     return true;
 }
 
@@ -598,7 +598,7 @@ static string radioDidlMake(const string& title, const string& uri,
                "xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\">\n"
                "<item id=\"\" parentID=\"\" restricted=\"True\">\n"
                "<dc:title>");
-    out += SoapHelp::xmlQuote(title);
+    xmlEscapeAppend(title, out);
     out += "</dc:title>\n"
         "<res protocolInfo=\"*:*:*:*\" bitrate=\"6000\">";
     if (uri.empty()) {
@@ -607,14 +607,14 @@ static string radioDidlMake(const string& title, const string& uri,
         // entries with uris). So fill up with bogus value. This is
         // not used anyway because setId/setPlaying use the value from
         // the radio array or from the metascript
-        out += SoapHelp::xmlQuote("http://www.bogus.com/bogus.mp3");
+        out += "http://www.bogus.com/bogus.mp3";
     } else {
-        out += SoapHelp::xmlQuote(uri);
+        xmlEscapeAppend(uri, out);
     }
     out += "</res>\n";
     if (!artUri.empty()) {
         out +=  "<upnp:albumArtURI>";
-        out += SoapHelp::xmlQuote(artUri);
+        xmlEscapeAppend(artUri, out);
         out += "</upnp:albumArtURI>\n";
     }
     out +=  "<upnp:class>object.item.audioItem</upnp:class>\n"
@@ -695,7 +695,7 @@ int OHRadio::readList(const SoapIncoming& sc, SoapOutgoing& data)
             out += "<Entry><Id>";
             out += *it;
             out += "</Id><Metadata>";
-            out += SoapHelp::xmlQuote(meta);
+            xmlEscapeAppend(meta, out);
             out += "</Metadata></Entry>";
         }
         out += "</ChannelList>";
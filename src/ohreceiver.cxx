@@ -36,6 +36,7 @@
 #include "upmpdutils.hxx"               // for didlmake, diffmaps, etc
 #include "ohplaylist.hxx"
 #include "ohproduct.hxx"
+#include "textkern.h"
 
 using namespace std;
 using namespace std::placeholders;
@@ -218,7 +219,7 @@ bool OHReceiver::iPlay()
         }
         if (id == -1) {
             UpSong metaformpd;
-            string metadata(SoapHelp::xmlUnquote(m_metadata));
+            string metadata(xmlUnescape(m_metadata));
             if (!uMetaToUpSong(metadata, &metaformpd)) {
                 LOGERR("OHReceiver::play: failed to parse metadata " << " Uri [" 
                        << m_httpuri << "] Metadata [" << metadata << "]"
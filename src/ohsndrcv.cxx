@@ -18,12 +18,12 @@
 #include "ohsndrcv.hxx"
 
 #include "libupnpp/log.hxx"
-#include "libupnpp/base64.hxx"
 
 #include "execmd.h"
 #include "upmpd.hxx"
 #include "mpdcli.hxx"
 #include "smallut.h"
+#include "textkern.h"
 #include "upmpdutils.hxx"
 #include "ohreceiver.hxx"
 #include "conftree.h"
@@ -186,8 +186,8 @@ bool SenderReceiver::start(const string& script, int seekms)
             m->clear();
             return false;
         }
-        uri = base64_decode(toks[3]);
-        meta = base64_decode(toks[5]);
+        uri = base64Decode(toks[3]);
+        meta = base64Decode(toks[5]);
         if (script.empty()) {
             m->iuri = uri;
             m->imeta = meta;
@@ -34,6 +34,7 @@
 #include "mpdcli.hxx"
 #include "upmpd.hxx"
 #include "upmpdutils.hxx"
+#include "textkern.h"
 
 using namespace std;
 using namespace std::placeholders;
@@ -138,7 +139,7 @@ bool UpMpdRenderCtl::getEventData(bool all, std::vector<std::string>& names,
             chgdata += " channel=\"Master\"";
         }
         chgdata += " val=\"";
-        chgdata += SoapHelp::xmlQuote(it->second);
+        xmlEscapeAppend(it->second, chgdata);
         chgdata += "\"/>\n";
     }
     chgdata += "</InstanceID>\n</Event>\n";
@@ -0,0 +1,363 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+
+#include "textkern.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TEXTKERN_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TEXTKERN_NEON
+#endif
+
+using namespace std;
+
+static inline bool isXmlSpecial(unsigned char c)
+{
+    // All the special characters are below '?'. Most text is not.
+    return c <= '>' &&
+        (c == '&' || c == '<' || c == '>' || c == '"' || c == '\'');
+}
+
+// Return the length of the initial segment of the input which needs
+// no escaping.
+static inline size_t xmlPlainSpan(const char *cp, size_t len)
+{
+    size_t i = 0;
+#if defined(TEXTKERN_SSE2)
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(cp + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, gt),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, quot),
+                                      _mm_cmpeq_epi8(v, apos))));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(TEXTKERN_NEON)
+    const uint8x16_t amp = vdupq_n_u8('&');
+    const uint8x16_t lt = vdupq_n_u8('<');
+    const uint8x16_t gt = vdupq_n_u8('>');
+    const uint8x16_t quot = vdupq_n_u8('"');
+    const uint8x16_t apos = vdupq_n_u8('\'');
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(cp + i));
+        uint8x16_t m = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, amp), vceqq_u8(v, lt)),
+            vorrq_u8(vceqq_u8(v, gt),
+                     vorrq_u8(vceqq_u8(v, quot), vceqq_u8(v, apos))));
+        uint64x2_t m64 = vreinterpretq_u64_u8(m);
+        if (vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1)) {
+            // Let the scalar loop find the exact position
+            break;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (isXmlSpecial((unsigned char)cp[i])) {
+            break;
+        }
+    }
+    return i;
+}
+
+void xmlEscapeAppend(const char *in, size_t len, string& out)
+{
+    const char *end = in + len;
+    while (in < end) {
+        size_t run = xmlPlainSpan(in, end - in);
+        out.append(in, run);
+        in += run;
+        if (in == end) {
+            break;
+        }
+        switch (*in++) {
+        case '&': out.append("&amp;", 5); break;
+        case '<': out.append("&lt;", 4); break;
+        case '>': out.append("&gt;", 4); break;
+        case '"': out.append("&quot;", 6); break;
+        default: out.append("&apos;", 6); break;
+        }
+    }
+}
+
+string xmlEscape(const string& in)
+{
+    string out;
+    out.reserve(in.size() + in.size() / 8 + 8);
+    xmlEscapeAppend(in.c_str(), in.size(), out);
+    return out;
+}
+
+static void utf8Append(string& out, uint32_t c)
+{
+    if (c < 0x80) {
+        out += char(c);
+    } else if (c < 0x800) {
+        out += char(0xc0 | (c >> 6));
+        out += char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += char(0xe0 | (c >> 12));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    } else {
+        out += char(0xf0 | (c >> 18));
+        out += char(0x80 | ((c >> 12) & 0x3f));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    }
+}
+
+// Translate the entity name (between & and ;). Return false if we
+// don't know it.
+static bool entityAppend(const char *nm, size_t len, string& out)
+{
+    if (len >= 2 && nm[0] == '#') {
+        uint32_t c = 0;
+        size_t i = 1;
+        int base = 10;
+        if (nm[1] == 'x' || nm[1] == 'X') {
+            base = 16;
+            i++;
+        }
+        if (i == len) {
+            return false;
+        }
+        for (; i < len; i++) {
+            unsigned char d = nm[i];
+            if (d >= '0' && d <= '9') {
+                d -= '0';
+            } else if (base == 16 && d >= 'a' && d <= 'f') {
+                d -= 'a' - 10;
+            } else if (base == 16 && d >= 'A' && d <= 'F') {
+                d -= 'A' - 10;
+            } else {
+                return false;
+            }
+            c = c * base + d;
+            if (c > 0x10ffff) {
+                return false;
+            }
+        }
+        utf8Append(out, c);
+        return true;
+    }
+    switch (len) {
+    case 2:
+        if (nm[1] != 't') {
+            return false;
+        }
+        if (nm[0] == 'l') {
+            out += '<';
+            return true;
+        } else if (nm[0] == 'g') {
+            out += '>';
+            return true;
+        }
+        return false;
+    case 3:
+        if (!memcmp(nm, "amp", 3)) {
+            out += '&';
+            return true;
+        }
+        return false;
+    case 4:
+        if (!memcmp(nm, "quot", 4)) {
+            out += '"';
+            return true;
+        } else if (!memcmp(nm, "apos", 4)) {
+            out += '\'';
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+string xmlUnescape(const string& in)
+{
+    // memchr is vectorized by the C library on all the platforms we
+    // care about, so this is the fastest way to look for the next
+    // entity.
+    string out;
+    out.reserve(in.size());
+    const char *cp = in.c_str();
+    const char *end = cp + in.size();
+    while (cp < end) {
+        const char *amp = (const char *)memchr(cp, '&', end - cp);
+        if (nullptr == amp) {
+            out.append(cp, end - cp);
+            break;
+        }
+        out.append(cp, amp - cp);
+        // Longest thing we know about is &#x10ffff; (10 chars with ;)
+        const char *lim = end - amp > 12 ? amp + 12 : end;
+        const char *semi = (const char *)memchr(amp + 1, ';', lim - amp - 1);
+        if (semi && entityAppend(amp + 1, semi - amp - 1, out)) {
+            cp = semi + 1;
+        } else {
+            out += '&';
+            cp = amp + 1;
+        }
+    }
+    return out;
+}
+
+static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void base64EncodeAppend(const char *in, size_t len, string& out)
+{
+    size_t opos = out.size();
+    out.resize(opos + 4 * ((len + 2) / 3));
+    char *op = &out[opos];
+    const unsigned char *ip = (const unsigned char *)in;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t v = (uint32_t(ip[i]) << 16) | (uint32_t(ip[i+1]) << 8) |
+            ip[i+2];
+        op[0] = b64chars[v >> 18];
+        op[1] = b64chars[(v >> 12) & 0x3f];
+        op[2] = b64chars[(v >> 6) & 0x3f];
+        op[3] = b64chars[v & 0x3f];
+        op += 4;
+    }
+    if (len - i == 1) {
+        uint32_t v = uint32_t(ip[i]) << 16;
+        op[0] = b64chars[v >> 18];
+        op[1] = b64chars[(v >> 12) & 0x3f];
+        op[2] = '=';
+        op[3] = '=';
+    } else if (len - i == 2) {
+        uint32_t v = (uint32_t(ip[i]) << 16) | (uint32_t(ip[i+1]) << 8);
+        op[0] = b64chars[v >> 18];
+        op[1] = b64chars[(v >> 12) & 0x3f];
+        op[2] = b64chars[(v >> 6) & 0x3f];
+        op[3] = '=';
+    }
+}
+
+string base64Encode(const string& in)
+{
+    string out;
+    base64EncodeAppend(in.c_str(), in.size(), out);
+    return out;
+}
+
+// Decoding table: 6 bits value or one of the following
+enum B64Special {B64INVAL = -1, B64SPACE = -2, B64PAD = -3};
+class B64DecodeTable {
+public:
+    B64DecodeTable() {
+        for (int i = 0; i < 256; i++) {
+            tbl[i] = B64INVAL;
+        }
+        for (int i = 0; i < 64; i++) {
+            tbl[(unsigned char)b64chars[i]] = i;
+        }
+        tbl[(unsigned char)' '] = tbl[(unsigned char)'\t'] =
+            tbl[(unsigned char)'\n'] = tbl[(unsigned char)'\r'] = B64SPACE;
+        tbl[(unsigned char)'='] = B64PAD;
+    }
+    signed char tbl[256];
+};
+static B64DecodeTable b64decodetable;
+
+bool base64Decode(const string& in, string& out)
+{
+    const signed char *tbl = b64decodetable.tbl;
+    out.clear();
+    out.reserve(in.size() / 4 * 3 + 3);
+    const unsigned char *ip = (const unsigned char *)in.c_str();
+    const unsigned char *end = ip + in.size();
+    uint32_t acc = 0;
+    int nacc = 0;
+    bool padseen = false;
+    while (ip < end) {
+        // Fast path: 4 significant characters in a row.
+        if (nacc == 0 && end - ip >= 4) {
+            int a = tbl[ip[0]], b = tbl[ip[1]], c = tbl[ip[2]], d = tbl[ip[3]];
+            if ((a | b | c | d) >= 0) {
+                if (padseen) {
+                    return false;
+                }
+                uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+                char o[3] = {char(v >> 16), char(v >> 8), char(v)};
+                out.append(o, 3);
+                ip += 4;
+                continue;
+            }
+        }
+        int v = tbl[*ip++];
+        if (v == B64SPACE) {
+            continue;
+        } else if (v == B64PAD) {
+            // Padding can only come after 2 or 3 significant chars
+            if (nacc < 2 && !padseen) {
+                return false;
+            }
+            padseen = true;
+            continue;
+        } else if (v < 0 || padseen) {
+            return false;
+        }
+        acc = (acc << 6) | v;
+        if (++nacc == 4) {
+            char o[3] = {char(acc >> 16), char(acc >> 8), char(acc)};
+            out.append(o, 3);
+            acc = 0;
+            nacc = 0;
+        }
+    }
+    switch (nacc) {
+    case 0:
+        break;
+    case 2:
+        out += char(acc >> 4);
+        break;
+    case 3:
+        out += char(acc >> 10);
+        out += char(acc >> 2);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+string base64Decode(const string& in)
+{
+    string out;
+    if (!base64Decode(in, out)) {
+        out.clear();
+    }
+    return out;
+}
@@ -0,0 +1,61 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#ifndef _TEXTKERN_H_INCLUDED_
+#define _TEXTKERN_H_INCLUDED_
+
+#include <stddef.h>
+
+#include <string>
+
+// Text conversion routines used on the SOAP hot paths: XML escaping
+// of DIDL and event data, un-escaping of received metadata, base64
+// for the OpenHome id arrays and the Songcast script outputs.
+//
+// These are drop-in replacements for the libupnpp SoapHelp::xmlQuote(),
+// SoapHelp::xmlUnquote(), base64_encode() and base64_decode()
+// functions, which process the data one byte at a time and build
+// their output by repeated appends. The scanning loops have SSE2
+// (x86) or NEON (ARM) versions when the compiler supports them, with
+// a portable fallback.
+
+/// Append XML-escaped copy of input to out. The 5 predefined
+/// entities are used (&amp; &lt; &gt; &quot; &apos;).
+extern void xmlEscapeAppend(const char *in, size_t len, std::string& out);
+inline void xmlEscapeAppend(const std::string& in, std::string& out)
+{
+    xmlEscapeAppend(in.c_str(), in.size(), out);
+}
+/// Return XML-escaped copy of input
+extern std::string xmlEscape(const std::string& in);
+
+/// Replace the predefined entities and the numeric character
+/// references with the characters they stand for. Unknown entities
+/// are left alone.
+extern std::string xmlUnescape(const std::string& in);
+
+/// Base64 encoding with padding, no line breaks.
+extern void base64EncodeAppend(const char *in, size_t len, std::string& out);
+extern std::string base64Encode(const std::string& in);
+
+/// Base64 decoding. White space is skipped. Returns false for
+/// invalid input, in which case the output is undefined.
+extern bool base64Decode(const std::string& in, std::string& out);
+/// Convenience version returning an empty string for invalid input.
+extern std::string base64Decode(const std::string& in);
+
+#endif /* _TEXTKERN_H_INCLUDED_ */
@@ -0,0 +1,109 @@
+/* Copyright (C) 2018 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+
+// Microbenchmark for the textkern routines, compared to the libupnpp
+// ones they replace. Not built by default: "make textkernbench"
+//
+// Usage: textkernbench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <functional>
+
+#include "libupnpp/soaphelp.hxx"
+#include "libupnpp/base64.hxx"
+
+#include "textkern.h"
+#include "chrono.h"
+
+using namespace std;
+using namespace UPnPP;
+
+// Somewhat realistic DIDL-ish data: mostly plain text with a
+// sprinkling of characters which need escaping.
+static string makeText(size_t sz)
+{
+    static const char *words[] = {
+        "Symphony", "No.", "5", "in", "C", "minor,", "Op.", "67:",
+        "Allegro", "con", "brio", "&", "<i>", "Karajan</i>", "\"live\"",
+        "l'orchestre", "http://192.168.1.2:9090/some/path?a=1&b=2"};
+    string out;
+    unsigned int i = 0;
+    while (out.size() < sz) {
+        out += words[i++ % (sizeof(words) / sizeof(words[0]))];
+        out += ' ';
+    }
+    return out;
+}
+
+static void runone(const char *what, int iters, size_t bytes,
+                   std::function<size_t()> func)
+{
+    Chrono chron;
+    size_t total = 0;
+    for (int i = 0; i < iters; i++) {
+        total += func();
+    }
+    long us = chron.micros();
+    printf("%-28s %8ld uS  %8.1f MB/s  (check %lu)\n", what, us,
+           us ? double(bytes) * iters / us : 0.0, (unsigned long)total);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 200;
+    if (iters <= 0) {
+        iters = 200;
+    }
+
+    const string text = makeText(256 * 1024);
+    const string quoted = xmlEscape(text);
+    if (quoted != SoapHelp::xmlQuote(text)) {
+        fprintf(stderr, "xmlEscape result differs from SoapHelp\n");
+        return 1;
+    }
+    string bin;
+    for (unsigned int i = 0; i < 64 * 1024; i++) {
+        bin += char((i * 2654435761U) >> 24);
+    }
+    const string b64 = base64Encode(bin);
+    if (b64 != base64_encode(bin) || base64Decode(b64) != bin) {
+        fprintf(stderr, "base64 results differ from libupnpp\n");
+        return 1;
+    }
+
+    runone("SoapHelp::xmlQuote", iters, text.size(),
+           [&]() {return SoapHelp::xmlQuote(text).size();});
+    runone("xmlEscape", iters, text.size(),
+           [&]() {return xmlEscape(text).size();});
+    runone("SoapHelp::xmlUnquote", iters, quoted.size(),
+           [&]() {return SoapHelp::xmlUnquote(quoted).size();});
+    runone("xmlUnescape", iters, quoted.size(),
+           [&]() {return xmlUnescape(quoted).size();});
+    runone("base64_encode", iters, bin.size(),
+           [&]() {return base64_encode(bin).size();});
+    runone("base64Encode", iters, bin.size(),
+           [&]() {return base64Encode(bin).size();});
+    runone("base64_decode", iters, b64.size(),
+           [&]() {return base64_decode(b64).size();});
+    runone("base64Decode", iters, b64.size(),
+           [&]() {return base64Decode(b64).size();});
+    return 0;
+}
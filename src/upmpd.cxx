@@ -20,7 +20,6 @@
 #include "libupnpp/device/device.hxx"   // for UpnpDevice, UpnpService
 #include "libupnpp/log.hxx"             // for LOGFAT, LOGERR, Logger, etc
 #include "libupnpp/upnpplib.hxx"        // for LibUPnP
-#include "libupnpp/control/cdircontent.hxx"
 
 #include "main.hxx"
 #include "smallut.h"
@@ -36,6 +35,7 @@
 #include "ohvolume.hxx"
 #include "renderctl.hxx"
 #include "upmpdutils.hxx"
+#include "didlparse.hxx"
 #include "execmd.h"
 #include "ohsndrcv.hxx"
 #include "protocolinfo.hxx"
@@ -254,8 +254,8 @@ bool UpMpd::checkContentFormat(const string& uri, const string& didl,
                                UpSong *ups, bool p_nocheck)
 {
     bool nocheck = (m_options & upmpdNoContentFormatCheck) || p_nocheck;
-    UPnPClient::UPnPDirContent dirc;
-    if (!dirc.parse(didl) || dirc.m_items.size() == 0) {
+    std::shared_ptr<const DidlSummary> sum = didlSummary(didl);
+    if (!sum->ok) {
         if (!didl.empty()) {
             LOGERR("checkContentFormat: didl parse failed\n");
         }
@@ -266,35 +266,30 @@ bool UpMpd::checkContentFormat(const string& uri, const string& didl,
             return false;
         }
     }
-    UPnPClient::UPnPDirObject& dobj = *dirc.m_items.begin();
 
     if (nocheck) {
         LOGINFO("checkContentFormat: format check disabled\n");
-        return dirObjToUpSong(dobj, ups);
+        didlSummaryToUpSong(*sum, ups);
+        return true;
     }
     
     const std::unordered_set<std::string>& supportedformats =
         Protocolinfo::the()->getsupportedformats();
 
-    for (vector<UPnPClient::UPnPResource>::const_iterator it =
-             dobj.m_resources.begin(); it != dobj.m_resources.end(); it++) {
-        if (!it->m_uri.compare(uri)) {
-            ProtocolinfoEntry e;
-            if (!it->protoInfo(e)) {
+    for (const auto& res : sum->resources) {
+        if (!res.uri.compare(uri)) {
+            if (!res.hasproto) {
                 LOGERR("checkContentFormat: resource has no protocolinfo\n");
                 return false;
             }
-            string cf = e.contentFormat;
+            const string& cf = res.contentFormat;
             if (supportedformats.find(cf) == supportedformats.end()) { // 
                 LOGERR("checkContentFormat: unsupported:: " << cf << endl);
                 return false;
             } else {
                 LOGDEB("checkContentFormat: supported: " << cf << endl);
-                if (ups) {
-                    return dirObjToUpSong(dobj, ups);
-                } else {
-                    return true;
-                }
+                didlSummaryToUpSong(*sum, ups);
+                return true;
             }
         }
     }
@@ -42,7 +42,6 @@
 #define O_STREAMING 0
 #endif
 #include <fstream>
-#include <sstream>
 #include <utility>
 #include <vector>
 
@@ -53,6 +52,8 @@
 
 #include "mpdcli.hxx"
 #include "smallut.h"
+#include "textkern.h"
+#include "didlparse.hxx"
 #include "pathut.h"
 #include "conftree.h"
 
@@ -128,88 +129,214 @@ diffmaps(const unordered_map<string, string>& old,
 }
 
 
+// The DIDL formatting code is on the hot path for all the big
+// ContentDirectory and OpenHome results, so it appends directly to
+// the caller buffer and avoids creating temporary strings.
+
+#define APPLIT(S) out.append(S, sizeof(S) - 1)
+
+// Append decimal representation of integer value, no allocation.
+static void appendInt(string& out, int64_t val)
+{
+    char buf[24];
+    char *cp = buf + sizeof(buf);
+    uint64_t uval = val < 0 ? 0 - uint64_t(val) : uint64_t(val);
+    do {
+        *--cp = char('0' + uval % 10);
+        uval /= 10;
+    } while (uval);
+    if (val < 0) {
+        *--cp = '-';
+    }
+    out.append(cp, buf + sizeof(buf) - cp);
+}
+
+// Same format as upnpduration(): H+:MM:SS
+static void appendDuration(string& out, int secs)
+{
+    appendInt(out, secs / 3600);
+    secs %= 3600;
+    char buf[6] = {':', char('0' + secs / 600), char('0' + (secs / 60) % 10),
+                   ':', char('0' + (secs % 60) / 10), char('0' + secs % 10)};
+    out.append(buf, sizeof(buf));
+}
+
 #define UPNPXML(FLD, TAG)                                               \
     if (!FLD.empty()) {                                                 \
-        ss << "<" #TAG ">" << SoapHelp::xmlQuote(FLD) << "</" #TAG ">"; \
+        APPLIT("<" #TAG ">");                                           \
+        xmlEscapeAppend(FLD, out);                                      \
+        APPLIT("</" #TAG ">");                                          \
     }
 #define UPNPXMLD(FLD, TAG, DEF)                                         \
     if (!FLD.empty()) {                                                 \
-        ss << "<" #TAG ">" << SoapHelp::xmlQuote(FLD) << "</" #TAG ">"; \
+        APPLIT("<" #TAG ">");                                           \
+        xmlEscapeAppend(FLD, out);                                      \
+        APPLIT("</" #TAG ">");                                          \
     } else {                                                            \
-        ss << "<" #TAG ">" << SoapHelp::xmlQuote(DEF) << "</" #TAG ">"; \
-    }
-
-static void printResource(ostringstream& ss, const UpSong::Res& res) {
-    ss << "<res";
-    if (res.duration_secs) {
-        ss << " duration=\"" << upnpduration(res.duration_secs * 1000) << "\"";
+        APPLIT("<" #TAG ">" DEF "</" #TAG ">");                         \
     }
-    if (res.size) {
-        ss << " size=\"" << lltodecstr(res.size) << "\"";
+// Optional property: only output if selected by the filter
+#define UPNPXMLF(FLD, TAG, FLAG)                                        \
+    if (props & UpSong::FLAG) {                                         \
+        UPNPXML(FLD, TAG);                                              \
     }
-    if (res.bitrate) {
-        ss << " bitrate=\"" << SoapHelp::i2s(res.bitrate) << "\"";
+#define UPNPATTR(FLD, ATTR, FLAG)                                       \
+    if (FLD && (props & UpSong::FLAG)) {                                \
+        APPLIT(" " #ATTR "=\"");                                        \
+        appendInt(out, FLD);                                            \
+        out += '"';                                                     \
     }
-    if (res.samplefreq) {
-        ss << " sampleFrequency=\"" << SoapHelp::i2s(res.samplefreq) << "\"";
+
+static void printResource(string& out, const UpSong::Res& res,
+                          unsigned int props)
+{
+    APPLIT("<res");
+    if (res.duration_secs && (props & UpSong::PF_RESDURATION)) {
+        APPLIT(" duration=\"");
+        appendDuration(out, res.duration_secs);
+        out += '"';
+    }
+    UPNPATTR(res.size, size, PF_RESSIZE);
+    UPNPATTR(res.bitrate, bitrate, PF_RESBITRATE);
+    UPNPATTR(res.samplefreq, sampleFrequency, PF_RESSAMPLEFREQ);
+    UPNPATTR(res.bitsPerSample, bitsPerSample, PF_RESBITS);
+    UPNPATTR(res.channels, nrAudioChannels, PF_RESCHANNELS);
+    if (!res.mime.empty()) {
+        APPLIT(" protocolInfo=\"http-get:*:");
+        xmlEscapeAppend(res.mime, out);
+        APPLIT(":* \"");
     }
-    if (res.bitsPerSample) {
-        ss << " bitsPerSample=\"" << SoapHelp::i2s(res.bitsPerSample) << "\"";
-    }            
-    if (res.channels) {
-        ss << " nrAudioChannels=\"" << SoapHelp::i2s(res.channels) << "\"";
+    out += '>';
+    xmlEscapeAppend(res.uri, out);
+    APPLIT("</res>");
+}
+
+// The estimate only needs to be in the right ballpark: it is used to
+// reserve the output buffer and avoid repeated reallocations.
+size_t UpSong::didlsize() const
+{
+    size_t sz = 380 + id.size() + parentid.size() + title.size() +
+        upnpClass.size() + tracknum.size() + genre.size() +
+        2 * artist.size() + date.size() + artUri.size();
+    if (!iscontainer) {
+        sz += 200 + album.size() + rsrc.uri.size() + rsrc.mime.size();
     }
-    if (!res.mime.empty()) {
-        ss << " protocolInfo=\"http-get:*:" << res.mime << ":* " << "\"";
+    return sz;
+}
+
+// Parse a ContentDirectory Browse/Search filter into a property
+// mask. The filter is a comma-separated list of property names
+// (e.g. "dc:creator,upnp:album,res@duration"), or "*". The required
+// properties (id, parentID, restricted, dc:title, upnp:class) are
+// always output. An empty filter should mean "required properties
+// only", but some control points send it when they mean "*", so we
+// treat it as such.
+unsigned int UpSong::parseFilter(const string& filter)
+{
+    static const unordered_map<string, unsigned int> propnames {
+        {"dc:creator", PF_CREATOR},
+        {"upnp:artist", PF_ARTIST},
+        {"upnp:album", PF_ALBUM},
+        {"upnp:genre", PF_GENRE},
+        {"dc:date", PF_DATE},
+        {"upnp:albumArtURI", PF_ARTURI},
+        {"upnp:originalTrackNumber", PF_TRACKNUM},
+        {"upnp:userAnnotation", PF_ANNOT},
+        {"res", PF_RES},
+        {"res@protocolInfo", PF_RES},
+        {"res@duration", PF_RES | PF_RESDURATION},
+        {"res@size", PF_RES | PF_RESSIZE},
+        {"res@bitrate", PF_RES | PF_RESBITRATE},
+        {"res@sampleFrequency", PF_RES | PF_RESSAMPLEFREQ},
+        {"res@bitsPerSample", PF_RES | PF_RESBITS},
+        {"res@nrAudioChannels", PF_RES | PF_RESCHANNELS},
+        {"@childCount", PF_CHILDCOUNT},
+        {"container@childCount", PF_CHILDCOUNT},
+    };
+
+    vector<string> names;
+    stringToTokens(filter, names, ", \t");
+    if (names.empty()) {
+        return PF_ALL;
+    }
+    unsigned int props = 0;
+    for (const auto& name : names) {
+        if (name == "*") {
+            return PF_ALL;
+        }
+        auto it = propnames.find(name);
+        if (it != propnames.end()) {
+            props |= it->second;
+        }
     }
-    ss << ">" << SoapHelp::xmlQuote(res.uri) << "</res>";
+    return props;
 }
 
-string UpSong::didl() const
+void UpSong::didl(string& out, unsigned int props) const
 {
-    ostringstream ss;
-    string typetag;
     if (iscontainer) {
-	typetag = "container";
+        APPLIT("<container");
     } else {
-	typetag = "item";
+        APPLIT("<item");
     }
-    ss << "<" << typetag;
     if (!id.empty()) {
-        ss << " id=\"" << id;
+        APPLIT(" id=\"");
+        xmlEscapeAppend(id, out);
+        out += '"';
     }
     if (!parentid.empty()) {
-        ss << "\" parentID=\"" << parentid << "\"";
+        APPLIT(" parentID=\"");
+        xmlEscapeAppend(parentid, out);
+        out += '"';
+    }
+    if (iscontainer && childCount >= 0 && (props & PF_CHILDCOUNT)) {
+        APPLIT(" childCount=\"");
+        appendInt(out, childCount);
+        out += '"';
     }
-    ss << " restricted=\"1\" searchable=\"" <<
-	(searchable ? string("1") : string("0")) << "\">" <<
-	"<dc:title>" << SoapHelp::xmlQuote(title) << "</dc:title>";
+    if (searchable) {
+        APPLIT(" restricted=\"1\" searchable=\"1\"><dc:title>");
+    } else {
+        APPLIT(" restricted=\"1\" searchable=\"0\"><dc:title>");
+    }
+    xmlEscapeAppend(title, out);
+    APPLIT("</dc:title>");
 
     if (id.empty()) {
-        ss << "<orig>mpd</orig>";
+        APPLIT("<orig>mpd</orig>");
     }
 
     if (iscontainer) {
         UPNPXMLD(upnpClass, upnp:class, "object.container");
         // tracknum is reused for annotations for containers
-        ss << (tracknum.empty() ? string() :
-               string("<upnp:userAnnotation>" + SoapHelp::xmlQuote(tracknum) +
-		    "</upnp:userAnnotation>"));
-	    
+        UPNPXMLF(tracknum, upnp:userAnnotation, PF_ANNOT);
     } else {
         UPNPXMLD(upnpClass, upnp:class, "object.item.audioItem.musicTrack");
-	UPNPXML(album, upnp:album);
-	UPNPXML(tracknum, upnp:originalTrackNumber);
-        printResource(ss, rsrc);
-    }
-    UPNPXML(genre, upnp:genre);
-    UPNPXML(artist, dc:creator);
-    UPNPXML(artist, upnp:artist);
-    UPNPXML(date, dc:date);
-    UPNPXML(artUri, upnp:albumArtURI);
-    ss << "</" << typetag << ">";
-    LOGDEB1("UpSong::didl(): " << ss.str() << endl);
-    return ss.str();
+        UPNPXMLF(album, upnp:album, PF_ALBUM);
+        UPNPXMLF(tracknum, upnp:originalTrackNumber, PF_TRACKNUM);
+        if (props & PF_RES) {
+            printResource(out, rsrc, props);
+        }
+    }
+    UPNPXMLF(genre, upnp:genre, PF_GENRE);
+    UPNPXMLF(artist, dc:creator, PF_CREATOR);
+    UPNPXMLF(artist, upnp:artist, PF_ARTIST);
+    UPNPXMLF(date, dc:date, PF_DATE);
+    UPNPXMLF(artUri, upnp:albumArtURI, PF_ARTURI);
+    if (iscontainer) {
+        APPLIT("</container>");
+    } else {
+        APPLIT("</item>");
+    }
+}
+
+string UpSong::didl() const
+{
+    string out;
+    out.reserve(didlsize());
+    didl(out);
+    LOGDEB1("UpSong::didl(): " << out << endl);
+    return out;
 }
 
 const string& headDIDL()
@@ -236,7 +363,12 @@ string wrapDIDL(const std::string& data)
 
 string didlmake(const UpSong& song)
 {
-    return wrapDIDL(song.didl());
+    string out;
+    out.reserve(headDIDL().size() + song.didlsize() + tailDIDL().size());
+    out += headDIDL();
+    song.didl(out);
+    out += tailDIDL();
+    return out;
 }
 
 bool dirObjToUpSong(const UPnPDirObject& dobj, UpSong *ups)
@@ -271,11 +403,12 @@ bool uMetaToUpSong(const string& metadata, UpSong *ups)
         return false;
     }
 
-    UPnPDirContent dirc;
-    if (!dirc.parse(metadata) || dirc.m_items.size() == 0) {
+    std::shared_ptr<const DidlSummary> sum = didlSummary(metadata);
+    if (!sum->ok) {
         return false;
     }
-    return dirObjToUpSong(*dirc.m_items.begin(), ups);
+    didlSummaryToUpSong(*sum, ups);
+    return true;
 }
     
 // Substitute regular expression
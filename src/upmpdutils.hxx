@@ -74,6 +74,8 @@ public:
     int mpdid{0};
     bool iscontainer{false};
     bool searchable{false};
+    // Number of children for a container, -1 if unknown.
+    int childCount{-1};
 
     std::string dump() {
         return std::string("class [" + upnpClass + "] Artist [" + artist +
@@ -82,6 +84,24 @@ public:
     }
     // Format to DIDL fragment 
     std::string didl() const;
+    // Optional properties for the DIDL output, selected by the
+    // Filter argument of ContentDirectory Browse/Search. The object
+    // attributes, title and class are always output.
+    enum PropFlags {
+        PF_CREATOR = 0x1, PF_ARTIST = 0x2, PF_ALBUM = 0x4, PF_GENRE = 0x8,
+        PF_DATE = 0x10, PF_ARTURI = 0x20, PF_TRACKNUM = 0x40,
+        PF_ANNOT = 0x80, PF_RES = 0x100, PF_RESDURATION = 0x200,
+        PF_RESSIZE = 0x400, PF_RESBITRATE = 0x800, PF_RESSAMPLEFREQ = 0x1000,
+        PF_RESBITS = 0x2000, PF_RESCHANNELS = 0x4000, PF_CHILDCOUNT = 0x8000,
+        PF_ALL = 0xffffffff
+    };
+    // Compute the property mask for a CDS filter string.
+    static unsigned int parseFilter(const std::string& filter);
+
+    // Append DIDL fragment to the output buffer.
+    void didl(std::string& out, unsigned int props = PF_ALL) const;
+    // Approximate size of the DIDL fragment, for buffer reservation.
+    size_t didlsize() const;
 
     static UpSong container(const std::string& id, const std::string& pid,
 			    const std::string& title, bool sable = true,